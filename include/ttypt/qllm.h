@@ -8,9 +8,64 @@
 extern "C" {
 #endif
 
+/* A token id in the model's vocabulary */
+typedef int32_t qllm_token;
+
 /* Opaque handle for the model + context */
 struct qllm_context;
 
+/* Opaque prompt prefix cache, shareable between contexts */
+struct qllm_cache;
+
+/* Opaque reference to loaded model weights */
+struct qllm_model;
+
+/* Opaque set of CPU threads, shareable between contexts */
+struct qllm_threadpool;
+
+/*
+ * Threadpool configuration. All fields optional.
+ */
+struct qllm_threadpool_config {
+	int32_t       n_threads;       /* Decode threads (default: half of the cores used) */
+	int32_t       n_threads_batch; /* Prompt prefill threads (default n_threads) */
+	const char   *cpus;       /* Use only these cores, like "0-7,16-23" */
+	int32_t       numa_node;  /* 1 + the NUMA node whose cores to use (0 = any) */
+	int           pin;        /* Pin each thread to one of those cores */
+	int32_t       poll;       /* Spin before sleeping, 1 to 100 (default 50, < 0: sleep at once) */
+};
+
+/* What a context is used for */
+enum qllm_mode {
+	QLLM_MODE_BOTH = 0,	/* generation and embeddings (default) */
+	QLLM_MODE_GENERATE,	/* logits only, no embedding output */
+	QLLM_MODE_EMBED,	/* pooled embeddings only */
+};
+
+/* Element type of the KV cache */
+enum qllm_kv_type {
+	QLLM_KV_F16 = 0,	/* default */
+	QLLM_KV_Q8_0,		/* about half the memory */
+	QLLM_KV_Q4_0,		/* about a quarter, at some cost in quality */
+};
+
+/*
+ * Sampling parameters. All zero means greedy decoding.
+ * Candidates are cut to top_k before anything else looks at them, so
+ * the rest of the chain costs O(k) rather than O(vocabulary).
+ */
+struct qllm_sampling {
+	float         temp;       /* Temperature (<= 0: greedy) */
+	int32_t       top_k;      /* Keep the k most likely (default 40 when temp > 0, < 0: all) */
+	float         top_p;      /* Nucleus sampling (0 = off) */
+	float         min_p;      /* Min probability relative to the best (0 = off) */
+	float         repeat_penalty;   /* Repetition penalty (0 or 1 = off) */
+	float         presence_penalty; /* Presence penalty (0 = off) */
+	float         freq_penalty;     /* Frequency penalty (0 = off) */
+	int32_t       penalty_last_n;   /* Tokens penalties look back on (default 64) */
+	uint32_t      seed;       /* RNG seed (0 = random) */
+};
+
 /*
  * Configuration structure for creating a QLLM context.
  * All fields optional except model_path.
@@ -21,17 +76,184 @@ struct qllm_config {
 	int32_t       n_threads;  /* Number of CPU threads (default: half of CPUs) */
 	uint32_t      max_offload_bytes; /* Max byte offload */
 	int32_t      n_contexts; /* How many contexts to account for */
+	struct qllm_cache *cache; /* Shared prefix cache (optional) */
+	int32_t       n_seq_max;  /* Sequences sharing the context (default 1, 8 for QLLM_MODE_EMBED) */
+	enum qllm_mode mode;      /* QLLM_MODE_BOTH by default */
+	int32_t       n_batch;    /* Max tokens per decode (default: whole context) */
+	int32_t       n_ubatch;   /* Prefill chunk / physical batch (default 512, QLLM_MODE_GENERATE only; n_batch otherwise) */
+	int32_t       n_keep;     /* Leading tokens kept when a full context shifts (default 0) */
+	int           no_shift;   /* Fail instead of shifting a full context */
+	const char   *draft_model_path; /* Speculative decoding draft model (optional) */
+	int32_t       n_draft;    /* Max tokens drafted per step (default 8) */
+	int32_t       n_lookup;   /* Prompt lookup n-gram size (0 = off, try 3) */
+	struct qllm_sampling sampling; /* Greedy by default */
+	const char   *trace_path; /* Start tracing into this file (optional) */
+	struct qllm_threadpool *threadpool; /* Shared CPU threads (optional, overrides n_threads) */
+	enum qllm_kv_type kv_type; /* KV cache type (default f16) */
+};
+
+/*
+ * Memory plan for a configuration, by qllm_plan(). Sizes are of host
+ * RAM, in bytes; what is offloaded to the GPU is left out.
+ */
+struct qllm_plan {
+	int32_t       n_ctx;      /* Tokens per sequence */
+	int32_t       n_seq_max;  /* Sequences per context */
+	int32_t       n_contexts; /* Contexts */
+	enum qllm_kv_type kv_type;
+	int32_t       n_gpu_layers; /* Layers offloaded, as qllm_create() would */
+	uint64_t      weights_bytes; /* Weights left in host RAM */
+	uint64_t      kv_bytes;   /* KV cache of every sequence of every context */
+	uint64_t      compute_bytes; /* Graph scratch, estimated */
+	uint64_t      host_avail; /* RAM available, cgroup limit included (0 = unknown) */
+	uint64_t      host_budget; /* What the plan may use of it */
+	int           downsized;  /* Less than asked for */
+};
+
+/*
+ * Speculative decoding counters. Each step decodes what was drafted in
+ * one batch of the main model, so (n_steps + n_accepted) / n_steps is
+ * the number of tokens generated per main model decode. The n_lookup
+ * fields count the steps drafted by prompt lookup on their own.
+ */
+struct qllm_spec_stats {
+	uint64_t      n_steps;    /* Verifying decodes */
+	uint64_t      n_drafted;  /* Tokens proposed */
+	uint64_t      n_accepted; /* Proposed tokens kept */
+	uint64_t      n_lookup;   /* Steps drafted by prompt lookup */
+	uint64_t      n_lookup_accepted; /* Tokens kept from those */
+};
+
+/*
+ * Performance counters of a context or sequence, timed with a
+ * monotonic clock. When sequences share a decode, each is charged by
+ * the share of tokens it had in the batch. Generated text is turned
+ * from tokens and matched against stop strings in t_detok_ns.
+ */
+struct qllm_stats {
+	uint64_t      n_tokenized;   /* Tokens out of the tokenizer */
+	uint64_t      n_prefilled;   /* Prompt tokens decoded */
+	uint64_t      n_reused;      /* Prompt tokens found in the KV or prefix cache */
+	uint64_t      n_generated;   /* Tokens generated and decoded */
+	uint64_t      t_tokenize_ns;
+	uint64_t      t_decode_ns;   /* In llama_decode(), drafts included */
+	uint64_t      t_sample_ns;
+	uint64_t      t_detok_ns;
+	uint64_t      n_reinit;      /* New prompts that dropped part of the KV cache */
+	uint64_t      n_shift;       /* Context shifts of a full KV cache */
+	int32_t       n_kv_used;     /* KV cells the sequence holds (not reset) */
+	int32_t       n_ctx;         /* KV cells it may hold */
 };
 
+/*
+ * Plan host memory for cfg before creating anything, from the model's
+ * real KV geometry (KV heads, head sizes, layers) and the RAM this
+ * process may still use (MemAvailable, capped by its memory cgroup).
+ * If what cfg asks for (n_ctx, n_seq_max, n_contexts) does not fit,
+ * the KV cache goes from f16 to q8_0, then sequences, then contexts
+ * are given up, then n_ctx is halved, and downsized is set. Copy the
+ * plan's fields back into cfg to follow it.
+ *
+ * Returns:
+ *   0  the plan fits (or RAM is unknown, and it is cfg as is)
+ *  <0  not even one small context fits, or error
+ */
+int
+qllm_plan(const struct qllm_config *cfg,
+	  struct qllm_plan *plan);
+
+/*
+ * Describe a plan in one line of text, for logs.
+ * Returns what snprintf() does, < 0 on error.
+ */
+int
+qllm_plan_print(const struct qllm_plan *plan,
+		char *buf,
+		size_t size);
+
+/*
+ * Models are loaded once per path and shared by every context created
+ * from it, from any thread; the weights are freed with the last
+ * context or reference.
+ *
+ * Take an extra reference on ctx's model, keeping it loaded after the
+ * context is gone, so later qllm_create() calls reuse it.
+ * Returns NULL on failure.
+ */
+struct qllm_model *
+qllm_model_retain(struct qllm_context *ctx);
+
+/*
+ * Drop a reference taken with qllm_model_retain().
+ */
+void
+qllm_model_release(struct qllm_model *model);
+
+/*
+ * Create a threadpool for contexts to share instead of each starting
+ * threads of its own, which oversubscribes the cores as soon as more
+ * than one is busy. Decodes on contexts sharing it take turns.
+ * With cpus and/or numa_node set, the threads only run on those
+ * cores, one each with pin; on multi-socket hosts one pool per node
+ * keeps each context's threads on a socket.
+ * Returns NULL on failure.
+ */
+struct qllm_threadpool *
+qllm_threadpool_create(const struct qllm_threadpool_config *cfg);
+
+/*
+ * Drop the reference qllm_threadpool_create() returned. Contexts using
+ * the pool keep it running until they are freed.
+ */
+void
+qllm_threadpool_free(struct qllm_threadpool *tp);
+
+/*
+ * Create a prompt prefix cache holding at most max_bytes of KV state.
+ * Contexts of the same model that share it start new prompts from the
+ * longest cached prefix instead of recomputing it. Least recently used
+ * entries are evicted first.
+ * Returns NULL on failure.
+ */
+struct qllm_cache *
+qllm_cache_create(size_t max_bytes);
+
+/*
+ * Free a prefix cache. Contexts using it must be freed first.
+ * This also drops the cache's reference on the model its states
+ * belong to.
+ */
+void
+qllm_cache_free(struct qllm_cache *cache);
+
 /*
  * Create a new QLLM context.
+ * With draft_model_path set (single sequence contexts only), a small
+ * model with the same vocabulary proposes n_draft tokens at a time to
+ * qllm_generate_stream() and qllm_next(), and the main model keeps
+ * those it would have picked itself.
+ * With n_lookup set, the last n_lookup tokens are first looked up in
+ * the context's own history (prompt included), and what followed them
+ * there is proposed instead, which needs no draft model and suits
+ * output that copies from the prompt.
  * Returns NULL on failure.
  */
 struct qllm_context *
 qllm_create(const struct qllm_config *cfg);
 
 /*
- * Free a QLLM context.
+ * Create a sequence on a context made with n_seq_max > 1.
+ * Sequences share the owner's weights, KV cache and compute buffers,
+ * each with its own n_ctx worth of positions, token history and
+ * sampler. The owner keeps sequence 0 for itself.
+ * Returns NULL when all sequences are taken.
+ */
+struct qllm_context *
+qllm_seq_create(struct qllm_context *ctx);
+
+/*
+ * Free a QLLM context or sequence.
+ * Sequences must be freed before their owner.
  */
 void
 qllm_free(struct qllm_context *ctx);
@@ -59,6 +281,9 @@ typedef void (*qllm_token_cb)(void *user,
 /*
  * Streaming generation.
  * Calls cb() for each generated text chunk.
+ * The context is kept between calls: whatever prefix the prompt shares
+ * with the tokens already in the KV cache is reused, and only the
+ * remaining suffix is decoded.
  * Returns 0 on success, < 0 on error.
  */
 int
@@ -81,6 +306,25 @@ qllm_embed(struct qllm_context *ctx,
 	   float *out,
 	   size_t out_dim);
 
+/*
+ * Compute embeddings for n texts at once.
+ * Texts are packed as separate sequences into each batch, up to the
+ * context's n_batch tokens and free sequences, so a context created
+ * with a larger n_seq_max embeds more of them per decode.
+ * Vector i is written at out + i * stride; stride must be >= the
+ * model embedding dimension.
+ *
+ * Returns:
+ *   >0  = embedding dimension (success)
+ *   <0  = error
+ */
+int
+qllm_embed_batch(struct qllm_context *ctx,
+		 const char **texts,
+		 size_t n,
+		 float *out,
+		 size_t stride);
+
 /*
  * Prime the context with a prompt.
  *
@@ -94,6 +338,8 @@ qllm_prime(struct qllm_context *ctx,
 
 /*
  * Generate the next token as text.
+ * A code point split across tokens comes out whole, with the token
+ * that completes it.
  *
  * Returns:
  *   >0  number of bytes written to 'out' (UTF-8, NUL-terminated)
@@ -105,6 +351,303 @@ qllm_next(struct qllm_context *ctx,
 	  char *out,
 	  size_t out_size);
 
+/*
+ * Like qllm_next(), but the text is handed to cb() straight from the
+ * context's buffer, valid only during the call, as whole UTF-8.
+ *
+ * Returns:
+ *   >0  number of bytes handed to cb()
+ *    0  end of generation (EOS)
+ *   <0  error
+ */
+int
+qllm_next_cb(struct qllm_context *ctx,
+	     qllm_token_cb cb,
+	     void *user);
+
+/*
+ * Tokenize text with the context's vocabulary, special tokens parsed.
+ * add_special adds BOS and the like, as a prompt would get.
+ *
+ * Returns:
+ *  >=0  number of tokens written to 'out'
+ *   <0  error, or minus the number needed when n_max is too small
+ */
+int32_t
+qllm_tokenize(struct qllm_context *ctx,
+	      const char *text,
+	      qllm_token *out,
+	      int32_t n_max,
+	      int add_special);
+
+/*
+ * Like qllm_prime(), with tokens made by qllm_tokenize() or kept from
+ * qllm_tokens().
+ *
+ * Returns:
+ *   0  on success
+ *  <0  on error
+ */
+int
+qllm_prime_tokens(struct qllm_context *ctx,
+		  const qllm_token *tokens,
+		  int32_t n_tokens);
+
+/*
+ * Like qllm_next(), but one token at a time: its id goes to *tok and
+ * its raw text (which may be part of a UTF-8 sequence) to 'out', if
+ * given. Stop strings are not held back; a completed one ends
+ * generation as usual, its last token not being returned.
+ *
+ * Returns:
+ *   1  a token
+ *   0  end of generation (EOS or a stop)
+ *  <0  error
+ */
+int
+qllm_next_token(struct qllm_context *ctx,
+		qllm_token *tok,
+		char *out,
+		size_t out_size);
+
+/*
+ * Raw text of a token, *len bytes long and not NUL-terminated. It lives
+ * as long as the model does.
+ * Returns NULL on error.
+ */
+const char *
+qllm_token_text(const struct qllm_context *ctx,
+		qllm_token tok,
+		size_t *len);
+
+/*
+ * Token history of the context (or sequence): what its KV cache holds,
+ * prompt and generated tokens alike. Valid until it is next used.
+ * Returns NULL on error.
+ */
+const qllm_token *
+qllm_tokens(const struct qllm_context *ctx,
+	    int32_t *n_tokens);
+
+/*
+ * Queue a prompt on a sequence for qllm_step(). It is appended to what
+ * the sequence already holds (or still has queued), and generation
+ * follows once it has been prefilled.
+ *
+ * Returns:
+ *   0  on success
+ *  <0  on error
+ */
+int
+qllm_seq_prompt(struct qllm_context *seq,
+		const char *prompt);
+
+/*
+ * Like qllm_seq_prompt(), but only prefills: no generation follows.
+ * Prompts queued before the previous one is prefilled are appended to
+ * it, and the last call decides whether a reply is generated.
+ */
+int
+qllm_seq_prefill(struct qllm_context *seq,
+		 const char *prompt);
+
+/*
+ * Returns non-zero while a sequence has prompt tokens queued or is
+ * still generating.
+ */
+int
+qllm_seq_busy(const struct qllm_context *seq);
+
+/*
+ * Continuous batching step over sequences of one context.
+ * Builds a single batch holding one decode token per generating
+ * sequence plus prefill chunks of queued prompts, up to n_max tokens
+ * (0 = n_batch), decodes it, and calls cb(user[i], ...) with the text
+ * of every token sampled for seqs[i].
+ *
+ * Returns:
+ *  >=0  number of sequences still busy
+ *   <0  error
+ */
+int
+qllm_step(struct qllm_context **seqs,
+	  size_t n,
+	  int32_t n_max,
+	  qllm_token_cb cb,
+	  void **user);
+
+/*
+ * Replace the sampling parameters of a context or sequence, for example
+ * before each request. NULL means greedy. Sequences start out with
+ * their owner's parameters.
+ * Returns 0 on success, < 0 on error.
+ */
+int
+qllm_set_sampling(struct qllm_context *ctx,
+		  const struct qllm_sampling *sp);
+
+/*
+ * Constrain what a context or sequence generates to a GBNF grammar
+ * (rule "root"), from the next prompt on; NULL removes it. Each token
+ * the sampler picks is checked against the grammar alone. If it is
+ * rejected, the draw is repeated, with the same random number, among
+ * the candidates the sampler kept; the whole vocabulary is only masked
+ * when none of them fits.
+ * Returns 0 on success, < 0 on error (bad grammar).
+ */
+int
+qllm_set_grammar(struct qllm_context *ctx,
+		 const char *gbnf);
+
+/*
+ * Like qllm_set_grammar(), with a JSON schema compiled to a grammar.
+ * Supported: type (or a list of types), properties and required
+ * (required ones first, then the others, in schema order), items and
+ * minItems, enum, const, anyOf and oneOf. Other keywords are ignored.
+ */
+int
+qllm_set_json_schema(struct qllm_context *ctx,
+		     const char *schema);
+
+/*
+ * End generation on a context or sequence before any of n stop
+ * strings would be output. Text that may be the start of one is held
+ * back until it is known not to be; stops that are a single token (like
+ * "<|im_end|>") are caught by id. Either way the stop is never decoded
+ * or returned, and tokens that went into it leave the history when the
+ * reply ends. n = 0 removes them.
+ * Returns 0 on success, < 0 on error.
+ */
+int
+qllm_set_stops(struct qllm_context *ctx,
+	       const char **stops,
+	       size_t n);
+
+/*
+ * Copy the speculative decoding counters of ctx into st, clearing them
+ * if reset is non-zero.
+ * Returns 0 on success, < 0 on error.
+ */
+int
+qllm_spec_stats(struct qllm_context *ctx,
+		struct qllm_spec_stats *st,
+		int reset);
+
+/*
+ * Timeline tracing, process wide. Tokenizing, decode batches,
+ * sampling, detokenizing and callbacks are recorded as spans, per
+ * thread, and written as Chrome trace-event JSON that Perfetto opens
+ * directly. Each thread keeps its most recent 65536 spans.
+ * Setting QLLM_TRACE=path in the environment, or trace_path in a
+ * qllm_config, starts it; the file is written at exit, or whenever
+ * qllm_trace_flush() is called (from an idle point).
+ *
+ * Start tracing into path. Returns 0 on success, < 0 on error.
+ */
+int
+qllm_trace_start(const char *path);
+
+/*
+ * Write what has been traced so far.
+ * Returns 0 on success, < 0 on error or when not tracing.
+ */
+int
+qllm_trace_flush(void);
+
+/*
+ * Application spans on the same timeline: qllm_trace_end() records
+ * one from t0, as returned by qllm_trace_begin(), with a number for
+ * argument. name is kept by pointer, so it must live until the trace
+ * is written (a string literal does). Both cost next to nothing when
+ * not tracing.
+ */
+uint64_t
+qllm_trace_begin(void);
+
+void
+qllm_trace_end(const char *name,
+	       uint64_t t0,
+	       int64_t arg);
+
+/*
+ * Time n draws of the next token from the current logits of ctx (prime
+ * it first), with its sampling chain and grammar, as qllm_next() would
+ * make them; neither is advanced. For benchmarks.
+ * Sets *ns to the mean time of one draw.
+ * Returns 0 on success, < 0 on error.
+ */
+int
+qllm_sample_time(struct qllm_context *ctx,
+		 int32_t n,
+		 uint64_t *ns);
+
+/*
+ * Copy the performance counters of ctx into st, clearing them if reset
+ * is non-zero.
+ * Returns 0 on success, < 0 on error.
+ */
+int
+qllm_get_stats(struct qllm_context *ctx,
+	       struct qllm_stats *st,
+	       int reset);
+
+/*
+ * Set how many leading tokens (typically the system prompt) survive
+ * when a full context or sequence shifts. Instead of failing, decoding
+ * past n_ctx drops the oldest half of the tokens after these and moves
+ * the rest back in the KV cache, without recomputing anything.
+ * n_keep < 0 keeps everything the context holds or has queued so far.
+ * Returns 0 on success, < 0 on error (or if created with no_shift).
+ */
+int
+qllm_keep(struct qllm_context *ctx,
+	  int32_t n_keep);
+
+/*
+ * Session state: the KV cache of a context (or sequence) together with
+ * its token history, so a restored context continues exactly where it
+ * was saved with qllm_prime()/qllm_seq_prompt(). Logits are not part
+ * of it; prime something before calling qllm_next().
+ *
+ * Bytes needed by qllm_state_get() (an upper bound), or 0 on error.
+ * This changes nothing.
+ */
+size_t
+qllm_state_size(struct qllm_context *ctx);
+
+/*
+ * Serialize the state into dst. This ends any reply in progress:
+ * generated tokens not handed out yet (speculation runs ahead) are
+ * dropped rather than saved.
+ * Returns bytes written, or 0 on error (including size too small).
+ */
+size_t
+qllm_state_get(struct qllm_context *ctx,
+	       void *dst,
+	       size_t size);
+
+/*
+ * Replace the context's state with one from qllm_state_get().
+ * Returns 0 on success, < 0 on error (the context is left empty).
+ */
+int
+qllm_state_set(struct qllm_context *ctx,
+	       const void *src,
+	       size_t size);
+
+/*
+ * File variants of the above. Loading maps the file instead of
+ * reading it.
+ * Return 0 on success, < 0 on error.
+ */
+int
+qllm_state_save(struct qllm_context *ctx,
+		const char *path);
+
+int
+qllm_state_load(struct qllm_context *ctx,
+		const char *path);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,4 +1,7 @@
 CFLAGS-libqllm-o := -fPIC
+CFLAGS-schema-o := -fPIC
+CFLAGS-trace-o := -fPIC
 CFLAGS-vulkan-o := -fPIC
 CFLAGS-metal-o := -fPIC
 CFLAGS-qllmd-o :=
+CFLAGS-qllm-bench-o :=
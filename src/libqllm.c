@@ -3,623 +3,4098 @@
 #include "./../include/ttypt/qllm.h"
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <llama.h>
+#include <ggml-cpu.h>
 #include <gguf.h>
 
 #include <ttypt/qsys.h>
 #include <ttypt/qmap.h>
 
+/*
+ * Model registry entry: one copy of the weights per path, shared by
+ * every context that uses it and freed with the last reference.
+ */
+struct qllm_model {
+	struct llama_model	*model;
+	char			*path;
+	unsigned		 refs;
+
+	/* Text of token i: pieces + piece_off[i], up to piece_off[i + 1] */
+	char			*pieces;
+	uint32_t		*piece_off;
+	int32_t			 n_vocab;
+	size_t			 piece_max;
+};
+
+/*
+ * Prefix cache: a radix tree keyed by token sequences. A node at depth
+ * d may own the serialized KV state of a sequence whose first d tokens
+ * spell the path from the root, so any state found below a node also
+ * covers that node's prefix.
+ */
+struct qllm_cache_node {
+	struct qllm_cache_node	*parent;
+	struct qllm_cache_node	*child;
+	struct qllm_cache_node	*next;		/* sibling */
+	struct qllm_cache_node	*lru_prev;
+	struct qllm_cache_node	*lru_next;
+
+	llama_token		*edge;
+	int32_t			 n_edge;
+	int32_t			 depth;
+
+	uint8_t			*state;
+	size_t			 state_size;
+};
+
+struct qllm_cache {
+	pthread_mutex_t		 lock;
+	struct qllm_cache_node	 root;
+	struct qllm_cache_node	*lru_head;	/* most recently used */
+	struct qllm_cache_node	*lru_tail;
+	struct qllm_model	*model;		/* referenced, states fit it */
+	size_t			 max_bytes;
+	size_t			 used;
+};
+
+/*
+ * CPU threads shared by contexts. A ggml threadpool runs one graph at
+ * a time, so decodes on contexts attached to it take turns on lock.
+ */
+struct qllm_threadpool {
+	pthread_mutex_t		 lock;
+	pthread_mutex_t		 ref_lock;
+	unsigned		 refs;
+	struct ggml_threadpool	*pool;
+	struct ggml_threadpool	*pool_batch;	/* may be pool */
+	int32_t			 n_threads;
+	int32_t			 n_threads_batch;
+};
+
+/* Shorter prefixes are cheaper to prefill than to copy around. */
+#define QLLM_CACHE_MIN_TOKENS 32
+
+/* Context size when none is given. */
+#define QLLM_N_CTX 512
+
+/* The planner halves n_ctx no further than this. */
+#define QLLM_PLAN_MIN_CTX 256
+
+/* llama's default physical batch. */
+#define QLLM_N_UBATCH 512
+
+/* Documents packed per batch by default in QLLM_MODE_EMBED. */
+#define QLLM_EMBED_SEQS 8
+
+/* Sampling defaults for fields left at 0. */
+#define QLLM_TOP_K 40
+#define QLLM_PENALTY_LAST_N 64
+
+/* Tokens a draft model proposes per step by default. */
+#define QLLM_SPEC_DRAFT 8
+
+#define QLLM_STATE_MAGIC 0x534c4c51	/* "QLLS" */
+#define QLLM_STATE_VERSION 1
+
+/*
+ * Saved state layout: this header, n_tokens tokens of history, then
+ * kv_size bytes of llama sequence state.
+ */
+struct qllm_state_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	int32_t		n_vocab;
+	int32_t		n_tokens;
+	uint64_t	kv_size;
+};
+
+/* Longest piece a single token turns into. */
+#define QLLM_PIECE_MAX 256
+
+/*
+ * Stop sequences: an Aho-Corasick automaton over bytes, expanded into
+ * a full transition table so each byte costs one lookup, and the stops
+ * that are a single token, which are caught by id.
+ */
+struct qllm_stop {
+	int32_t		(*next)[256];
+	int32_t		*depth;		/* bytes matched so far */
+	int32_t		*match;		/* length of a stop ending here */
+	llama_token	*tokens;
+	size_t		 n_tokens;
+	size_t		 max_len;
+
+	int32_t		 state;
+	char		*hold;		/* the partial match, held back */
+	size_t		 n_hold;
+};
+
 struct qllm_context {
+	struct qllm_model	*entry;		/* owner: registry reference */
 	struct llama_model	*model;
 	struct llama_context	*ctx;
 	struct llama_sampler	*sampler;
+	struct qllm_sampling	 sampling;
+	struct llama_sampler	*grammar;	/* output constraint */
+	uint64_t		 rng;		/* draw state, qllm_rand() */
+	llama_token_data	*cand;		/* candidates: full vocab */
+	struct qllm_stop	*stop;		/* stop sequences */
+
+	/* Generated text not handed out yet */
+	char			*text;
+	size_t			 text_len, text_off, text_cap;
+	int			 ended;		/* generation is over */
+	int32_t			 n_commit;	/* spec_buf: for qllm_next_token() */
+	int32_t			 commit_off;
+
+	/* The reply in token_buf, to take back what was never handed out */
+	int			 gen_live;	/* gen_pos is set */
+	llama_pos		 gen_pos;	/* where it starts */
+	size_t			 gen_out;	/* bytes of its text handed out */
+	llama_pos		 gen_seen;	/* qllm_next_token(): end of those returned */
+	struct qllm_cache	*cache;
 	struct llama_context_params params; /* <-- add this */
 	const struct llama_vocab *vocab;
+	const struct qllm_model	*words;		/* piece table */
+	struct qllm_threadpool	*tp;		/* owner: referenced */
+	enum qllm_mode		 mode;
 
 	int32_t			 n_embd;
 	int32_t			 max_tokens;
 	llama_pos		 cur_pos;
-
-	llama_token		*token_buf;
-	llama_seq_id		*seq_ids;
+	int32_t			 n_keep;	/* kept when shifting, -1: no shift */
+	int			 shifted;	/* KV past n_keep was moved */
+
+	llama_token		*token_buf;	/* tokens in the KV cache */
+	llama_token		*prompt_buf;	/* tokenizer scratch */
+
+	/* Sequences share the owner's llama_context and KV cache. */
+	struct qllm_context	*owner;		/* NULL for the owner itself */
+	llama_seq_id		 seq_id;
+	int32_t			 n_seq_max;
+	uint8_t			*seq_used;	/* owner: ids handed out */
+	struct llama_batch	 batch;		/* owner: qllm_step() batch */
+	int32_t			*step_idx;	/* owner: logits row per seq */
+	int32_t			*step_add;	/* owner: tokens added per seq */
+
+	/* qllm_step() state */
+	int32_t			 n_pending;	/* queued prompt tokens */
+	int32_t			 pending_off;	/* next one in prompt_buf */
+	llama_token		 next_tok;	/* sampled, not yet decoded */
+	int			 has_next;
+	int			 fresh;		/* prompt started empty */
+	int			 gen;		/* generate after prefill */
+
+	/* Speculative decoding (owner with n_seq_max == 1 only) */
+	struct qllm_model	*draft_entry;
+	struct llama_context	*draft_ctx;
+	struct llama_sampler	*draft_smpl;
+	struct llama_batch	 draft_batch;
+	llama_token		*draft_hist;	/* tokens in the draft KV */
+	llama_pos		 draft_pos;
+	int32_t			 n_draft;	/* max proposed per step */
+	llama_token		*spec_buf;	/* proposed, then committed */
+	int32_t			 n_lookup;	/* prompt lookup n-gram size */
+	int32_t			*lookup;	/* n-gram hash -> end pos + 1 */
+	uint32_t		 lookup_mask;
+	llama_pos		 lookup_pos;	/* token_buf indexed up to */
+	struct qllm_spec_stats	 spec;
+	struct qllm_stats	 stats;
 };
 
 static int qllm_backend_inited;
 static uint32_t qm_model, model_hd;
+static pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Initialize llama backend exactly once. */
 __attribute__((constructor)) void 
 qllm_init(void)
 {
-	qm_model = qmap_reg(sizeof(struct llama_model *));
+	qm_model = qmap_reg(sizeof(struct qllm_model *));
 	model_hd = qmap_open(NULL, NULL, QM_STR, qm_model, 0, 0);
 	llama_backend_init();
 	qllm_backend_inited = 1;
 }
 
-/* Small helper to decode a batch of tokens at the current position. */
+extern int qllm_trace_on;
+
+extern void
+qllm_trace_span(const char *name, uint64_t t0, uint64_t t1, int64_t arg);
+
+/* Timeline probes (trace.c); one branch when tracing is off. */
+#define QLLM_TRACE_T0() \
+	(__builtin_expect(qllm_trace_on, 0) ? qllm_now_ns() : 0)
+#define QLLM_TRACE(name, t0, t1, arg) do { \
+	if (__builtin_expect(qllm_trace_on, 0) && (t0)) \
+		qllm_trace_span(name, t0, t1, arg); \
+} while (0)
+
+/* Monotonic time in ns, for the counters. */
+static inline uint64_t
+qllm_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/* llama_decode(), its time charged to qctx. */
 static int
-qllm_decode_tokens(struct qllm_context *qctx,
-		   const llama_token *tokens,
-		   int32_t n_tokens)
+qllm_llama_decode(struct qllm_context *qctx,
+		  struct llama_context *ctx,
+		  struct llama_batch *batch)
 {
-	struct llama_batch batch;
-	int32_t i;
+	struct qllm_threadpool *tp = qctx->tp;
+	uint64_t t0, t1;
+	int ret;
 
-	if (!qctx || !qctx->ctx || !tokens || n_tokens <= 0)
-		return -1;
+	if (tp)
+		pthread_mutex_lock(&tp->lock);
+	t0 = qllm_now_ns();
+	ret = llama_decode(ctx, *batch);
+	t1 = qllm_now_ns();
+	if (tp)
+		pthread_mutex_unlock(&tp->lock);
+	qctx->stats.t_decode_ns += t1 - t0;
+	QLLM_TRACE("decode", t0, t1, batch->n_tokens);
+	return ret;
+}
 
-	if (n_tokens > qctx->max_tokens)
-		return -1;
+/* Append one token for `seq` to a batch. */
+static void
+qllm_batch_add(struct llama_batch *batch,
+	       struct qllm_context *seq,
+	       llama_token tok,
+	       llama_pos pos,
+	       int logits)
+{
+	int32_t i = batch->n_tokens++;
+
+	batch->token[i] = tok;
+	batch->pos[i] = pos;
+	batch->n_seq_id[i] = 1;
+	batch->seq_id[i][0] = seq->seq_id;
+	batch->logits[i] = (int8_t)logits;
+}
+
+/* Text of a token, from the piece table. */
+static inline const char *
+qllm_piece(const struct qllm_context *qctx, llama_token tok, size_t *len)
+{
+	const struct qllm_model *w = qctx->words;
+
+	if (tok < 0 || tok >= w->n_vocab) {
+		*len = 0;
+		return "";
+	}
+
+	*len = w->piece_off[tok + 1] - w->piece_off[tok];
+	return w->pieces + w->piece_off[tok];
+}
+
+/*
+ * token_buf changes from pos on: index it again from there. Stale
+ * entries are harmless, lookups check what they find.
+ */
+static inline void
+qllm_lookup_trim(struct qllm_context *qctx, llama_pos pos)
+{
+	if (qctx->lookup_pos > pos)
+		qctx->lookup_pos = pos;
+}
+
+/* Forget the history from pos on, KV cache included. */
+static void
+qllm_truncate(struct qllm_context *qctx, llama_pos pos)
+{
+	if (pos >= qctx->cur_pos)
+		return;
+
+	llama_memory_seq_rm(llama_get_memory(qctx->ctx), qctx->seq_id,
+	    pos, -1);
+	qctx->cur_pos = pos;
+	qllm_lookup_trim(qctx, pos);
+}
 
-	batch = llama_batch_init(n_tokens, 0, 1);
-	batch.n_tokens = n_tokens;
+/*
+ * The reply loses the tokens from n_keep to n_keep + n_discard to a
+ * shift: what they brought stops counting as handed out.
+ */
+static void
+qllm_gen_shift(struct qllm_context *qctx, llama_pos n_keep, int32_t n_discard)
+{
+	llama_pos p, end = n_keep + n_discard;
+	size_t n;
 
-	for (i = 0; i < n_tokens; ++i) {
-		batch.token[i] = tokens[i];
-		batch.pos[i] = qctx->cur_pos + i;
-		batch.n_seq_id[i] = 1;
-		qctx->seq_ids[i] = 0;
-		batch.seq_id[i] = &qctx->seq_ids[i];
-		batch.logits[i] = (i == n_tokens - 1);
+	for (p = qctx->gen_pos > n_keep ? qctx->gen_pos : n_keep; p < end; p++) {
+		qllm_piece(qctx, qctx->token_buf[p], &n);
+		qctx->gen_out -= n < qctx->gen_out ? n : qctx->gen_out;
 	}
 
-	if (llama_decode(qctx->ctx, batch) != 0)
+	if (qctx->gen_pos > n_keep)
+		qctx->gen_pos = qctx->gen_pos > end
+		    ? qctx->gen_pos - n_discard : n_keep;
+	if (qctx->gen_seen > n_keep)
+		qctx->gen_seen = qctx->gen_seen > end
+		    ? qctx->gen_seen - n_discard : n_keep;
+}
+
+/*
+ * Make room for n_need more tokens by dropping the oldest ones after
+ * the first n_keep and sliding the rest back in the KV cache, the way
+ * llama.cpp's context shift does: half of the movable span goes at
+ * once, so shifts stay rare. Nothing is decoded again.
+ */
+static int
+qllm_shift(struct qllm_context *qctx, int32_t n_need)
+{
+	llama_memory_t mem;
+	int32_t n_keep, n_discard;
+
+	if (n_need <= qctx->max_tokens - qctx->cur_pos)
+		return 0;
+
+	n_keep = qctx->n_keep;
+	if (n_keep < 0 || n_keep > qctx->cur_pos
+	    || n_need > qctx->max_tokens - n_keep)
+		return -1;
+
+	mem = llama_get_memory(qctx->ctx);
+	if (!llama_memory_can_shift(mem))
 		return -1;
 
-	qctx->cur_pos += n_tokens;
+	n_discard = (qctx->cur_pos - n_keep) / 2;
+	if (n_discard < n_need - (qctx->max_tokens - qctx->cur_pos))
+		n_discard = n_need - (qctx->max_tokens - qctx->cur_pos);
+
+	if (!llama_memory_seq_rm(mem, qctx->seq_id, n_keep,
+	    n_keep + n_discard))
+		return -1;
+	llama_memory_seq_add(mem, qctx->seq_id, n_keep + n_discard,
+	    qctx->cur_pos, -n_discard);
+
+	if (qctx->gen_live)
+		qllm_gen_shift(qctx, n_keep, n_discard);
+
+	memmove(qctx->token_buf + n_keep, qctx->token_buf + n_keep + n_discard,
+	    (size_t)(qctx->cur_pos - n_keep - n_discard)
+	    * sizeof(*qctx->token_buf));
+	qctx->cur_pos -= n_discard;
+	qctx->shifted = 1;
+	qctx->stats.n_shift++;
+	qllm_lookup_trim(qctx, n_keep);
 	return 0;
 }
 
-extern void
-qllm_backend_mem_check(int gpu, size_t *free_b, size_t *total_b);
+/*
+ * Decode tokens for `seq` from position pos on, through `batch` one
+ * ubatch of `ctx` at a time; only the last token requests logits.
+ * Returns how many were decoded, which is n_tokens unless one failed.
+ */
+static int32_t
+qllm_decode_run(struct llama_context *ctx,
+		struct llama_batch *batch,
+		struct qllm_context *seq,
+		const llama_token *tokens,
+		int32_t n_tokens,
+		llama_pos pos)
+{
+	int32_t i, off, chunk, n_chunk;
+
+	n_chunk = (int32_t) llama_n_ubatch(ctx);
+
+	for (off = 0; off < n_tokens; off += chunk) {
+		chunk = n_tokens - off;
+		if (chunk > n_chunk)
+			chunk = n_chunk;
+
+		batch->n_tokens = 0;
+		for (i = 0; i < chunk; ++i)
+			qllm_batch_add(batch, seq, tokens[off + i],
+			    pos + off + i, off + i == n_tokens - 1);
+
+		if (qllm_llama_decode(seq, ctx, batch) != 0)
+			break;
+	}
+
+	return off;
+}
 
+/*
+ * Small helper to decode a batch of tokens at the current position.
+ * The tokens are appended to token_buf, which mirrors the KV cache.
+ * Long inputs go through the owner's preallocated batch.
+ */
 static int
-auto_ngl(const char *path, int gpu, uint32_t n_ctx, uint32_t max_offload_bytes,
-	 int n_layers, int n_embd, int n_contexts)
+qllm_decode_tokens(struct qllm_context *qctx,
+		   const llama_token *tokens,
+		   int32_t n_tokens)
 {
-	size_t free_b, total_b;
-	struct gguf_init_params ip = { .no_alloc = true };
-	struct gguf_context *ctx;
-	size_t *layer_sizes;
-	size_t usable;
-	size_t kv_size_per_ctx;
-	size_t workspace_per_ctx;
-	size_t this_ctx_cost;
-	size_t per_other_ctx_cost = 0;
-	size_t other_ctx_cost = 0;
-	size_t system_overhead;
-	size_t reserve;
-	size_t used;
-	size_t largest_layer;
-	int n_tensors;
-	int ngl;
-	int i;
+	struct llama_batch *batch;
+	int32_t n;
 
-	if (n_contexts <= 0)
-		n_contexts = 1;
+	if (!qctx || !qctx->ctx || !tokens || n_tokens <= 0)
+		return -1;
 
-	qllm_backend_mem_check(gpu, &free_b, &total_b);
-	if (!total_b || !free_b)
-		return 0;
+	if (qllm_shift(qctx, n_tokens) != 0)
+		return -1;
 
-	usable = free_b;
-	if (!usable)
-		return 0;
+	if (tokens != qctx->token_buf + qctx->cur_pos) {
+		memmove(qctx->token_buf + qctx->cur_pos, tokens,
+		    (size_t)n_tokens * sizeof(*tokens));
+		tokens = qctx->token_buf + qctx->cur_pos;
+	}
 
-	ctx = gguf_init_from_file(path, ip);
-	if (!ctx)
-		return 0;
+	batch = qctx->owner ? &qctx->owner->batch : &qctx->batch;
+	n = qllm_decode_run(qctx->ctx, batch, qctx, tokens, n_tokens,
+	    qctx->cur_pos);
+	qctx->cur_pos += n;
 
-	n_tensors = (int)gguf_get_n_tensors(ctx);
-	if (n_layers <= 0 || n_embd <= 0 || n_tensors <= 0) {
-		gguf_free(ctx);
-		return 0;
+	return n == n_tokens ? 0 : -1;
+}
+
+struct qllm_cache *
+qllm_cache_create(size_t max_bytes)
+{
+	struct qllm_cache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+		free(cache);
+		return NULL;
 	}
 
-	layer_sizes = calloc((size_t)n_layers, sizeof(*layer_sizes));
-	if (!layer_sizes) {
-		gguf_free(ctx);
-		return 0;
+	cache->max_bytes = max_bytes;
+	return cache;
+}
+
+static void
+qllm_cache_node_free(struct qllm_cache_node *node)
+{
+	struct qllm_cache_node *child, *next;
+
+	for (child = node->child; child; child = next) {
+		next = child->next;
+		qllm_cache_node_free(child);
 	}
 
-	for (i = 0; i < n_tensors; i++) {
-		const char *name = gguf_get_tensor_name(ctx, i);
-		const char *p;
-		long layer;
+	free(node->edge);
+	free(node->state);
+	free(node);
+}
 
-		if (!name)
-			continue;
+void
+qllm_cache_free(struct qllm_cache *cache)
+{
+	struct qllm_cache_node *child, *next;
 
-		p = strstr(name, "blk.");
-		if (!p) p = strstr(name, "layers.");
-		if (!p) p = strstr(name, "block.");
-		if (!p)
-			continue;
+	if (!cache)
+		return;
 
-		while (*p && !isdigit((unsigned char)*p))
-			p++;
-		if (!isdigit((unsigned char)*p))
-			continue;
+	for (child = cache->root.child; child; child = next) {
+		next = child->next;
+		qllm_cache_node_free(child);
+	}
 
-		layer = strtol(p, NULL, 10);
-		if (layer < 0 || layer >= n_layers)
-			continue;
+	qllm_model_release(cache->model);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
 
-		layer_sizes[layer] += gguf_get_tensor_size(ctx, i);
+/* Add the cores of a list like "0-7,16-23" to mask. Returns how many. */
+static int
+qllm_cpus_parse(const char *list, bool *mask)
+{
+	long lo, hi, c;
+	int n = 0;
+	char *e;
+
+	while (*list) {
+		lo = strtol(list, &e, 10);
+		if (e == list || lo < 0)
+			return -1;
+		hi = lo;
+		if (*e == '-') {
+			list = e + 1;
+			hi = strtol(list, &e, 10);
+			if (e == list || hi < lo)
+				return -1;
+		}
+
+		for (c = lo; c <= hi && c < GGML_MAX_N_THREADS; c++)
+			if (!mask[c]) {
+				mask[c] = true;
+				n++;
+			}
+
+		while (*e == ',' || *e == ' ' || *e == '\n')
+			e++;
+		list = e;
 	}
 
-	gguf_free(ctx);
+	return n;
+}
 
-	largest_layer = 0;
-	for (i = 0; i < n_layers; i++)
-		if (layer_sizes[i] > largest_layer)
-			largest_layer = layer_sizes[i];
+/* Add the cores of NUMA node `node` to mask. Returns how many. */
+static int
+qllm_numa_cpus(int32_t node, bool *mask)
+{
+	char path[64], list[1024];
+	FILE *fp;
+	int n = -1;
 
-	workspace_per_ctx = largest_layer + (64 * 1024 * 1024);
+	snprintf(path, sizeof(path),
+	    "/sys/devices/system/node/node%d/cpulist", node);
 
-	/* 2 * n_ctx * n_embd * n_layers * sizeof(f16) == 4 * n_ctx * n_embd * n_layers */
-	kv_size_per_ctx =
-	    (size_t)n_ctx *
-	    (size_t)n_embd *
-	    25ULL *
-	    (size_t)n_layers;
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
 
-	system_overhead = kv_size_per_ctx / 10;
+	if (fgets(list, sizeof(list), fp))
+		n = qllm_cpus_parse(list, mask);
 
-	this_ctx_cost = kv_size_per_ctx + workspace_per_ctx;
+	fclose(fp);
+	return n;
+}
 
-	if (n_contexts > 1) {
-		per_other_ctx_cost = this_ctx_cost + (this_ctx_cost >> 1);
-		other_ctx_cost = per_other_ctx_cost * (size_t)(n_contexts - 1);
+static struct ggml_threadpool *
+qllm_ggml_pool(const struct qllm_threadpool_config *cfg,
+	       const bool *mask,
+	       int32_t n_threads)
+{
+	struct ggml_threadpool_params params;
+
+	params = ggml_threadpool_params_default(n_threads);
+
+	if (mask) {
+		memcpy(params.cpumask, mask, sizeof(params.cpumask));
+		params.strict_cpu = cfg->pin != 0;
 	}
 
-	/* reserva fixa para driver/SO */
-	reserve = 128 * 1024 * 1024ULL;
+	if (cfg->poll > 0)
+		params.poll = (uint32_t) (cfg->poll > 100 ? 100 : cfg->poll);
+	else if (cfg->poll < 0)
+		params.poll = 0;
 
-	if (usable <= reserve + this_ctx_cost + other_ctx_cost + system_overhead) {
-		free(layer_sizes);
-		return 0;
+	return ggml_threadpool_new(&params);
+}
+
+struct qllm_threadpool *
+qllm_threadpool_create(const struct qllm_threadpool_config *cfg)
+{
+	static const struct qllm_threadpool_config defaults = { 0 };
+	struct qllm_threadpool *tp;
+	bool mask[GGML_MAX_N_THREADS] = { false };
+	int n_cpus = 0, n;
+	long ncpu;
+
+	if (!cfg)
+		cfg = &defaults;
+
+	if (cfg->cpus) {
+		n = qllm_cpus_parse(cfg->cpus, mask);
+		if (n <= 0)
+			return NULL;
+		n_cpus = n;
 	}
 
-	usable -= reserve;
-	usable -= this_ctx_cost + other_ctx_cost + system_overhead;
+	/* Only this node's cores; with cpus too, both sets. */
+	if (cfg->numa_node > 0) {
+		n = qllm_numa_cpus(cfg->numa_node - 1, mask);
+		if (n < 0)
+			return NULL;
+		n_cpus += n;
+	}
 
-	if (max_offload_bytes > 0 && usable > max_offload_bytes)
-		usable = max_offload_bytes;
+	if (!n_cpus) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		n_cpus = ncpu > 0 ? (int) ncpu : 1;
+	}
 
-	used = 0;
-	ngl = 0;
+	tp = calloc(1, sizeof(*tp));
+	if (!tp)
+		return NULL;
 
-	for (i = 0; i < n_layers; i++) {
-		size_t weight = layer_sizes[i];
-		size_t need   = weight * 5 / 2;
+	tp->n_threads = cfg->n_threads > 0 ? cfg->n_threads
+	    : (n_cpus > 1 ? n_cpus / 2 : 1);
+	tp->n_threads_batch = cfg->n_threads_batch > 0
+	    ? cfg->n_threads_batch : tp->n_threads;
 
-		if (used + need > usable)
-			break;
+	pthread_mutex_init(&tp->lock, NULL);
+	pthread_mutex_init(&tp->ref_lock, NULL);
+	tp->refs = 1;
 
-		used += need;
-		ngl++;
+	tp->pool = qllm_ggml_pool(cfg, cfg->cpus || cfg->numa_node > 0
+	    ? mask : NULL, tp->n_threads);
+	if (!tp->pool)
+		goto fail;
+
+	tp->pool_batch = tp->pool;
+	if (tp->n_threads_batch != tp->n_threads) {
+		tp->pool_batch = qllm_ggml_pool(cfg, cfg->cpus
+		    || cfg->numa_node > 0 ? mask : NULL, tp->n_threads_batch);
+		if (!tp->pool_batch)
+			goto fail;
 	}
 
-	free(layer_sizes);
-	return ngl;
+	return tp;
+
+fail:
+	tp->refs = 0;
+	qllm_threadpool_free(tp);
+	return NULL;
 }
 
-struct llama_model *model_load(
-		const char *path,
-		int32_t n_ctx,
-		uint32_t ngl_max,
-		int32_t n_contexts)
+static struct qllm_threadpool *
+qllm_threadpool_retain(struct qllm_threadpool *tp)
 {
-	struct llama_model_params model_params;
-	struct llama_model ** model_r, *model;
-	int n_layers, n_embd, ngl;
+	pthread_mutex_lock(&tp->ref_lock);
+	tp->refs++;
+	pthread_mutex_unlock(&tp->ref_lock);
+	return tp;
+}
 
-	model_r = (struct llama_model **) qmap_get(model_hd, path);
-	if (model_r)
-		return *model_r;
+void
+qllm_threadpool_free(struct qllm_threadpool *tp)
+{
+	if (!tp)
+		return;
 
-	if (!n_contexts)
-		n_contexts = 1;
+	pthread_mutex_lock(&tp->ref_lock);
+	if (tp->refs && --tp->refs) {
+		pthread_mutex_unlock(&tp->ref_lock);
+		return;
+	}
+	pthread_mutex_unlock(&tp->ref_lock);
+
+	if (tp->pool_batch && tp->pool_batch != tp->pool)
+		ggml_threadpool_free(tp->pool_batch);
+	if (tp->pool)
+		ggml_threadpool_free(tp->pool);
+	pthread_mutex_destroy(&tp->lock);
+	pthread_mutex_destroy(&tp->ref_lock);
+	free(tp);
+}
 
-	model_params = llama_model_default_params();
+static void
+qllm_cache_lru_unlink(struct qllm_cache *cache, struct qllm_cache_node *node)
+{
+	if (node->lru_prev)
+		node->lru_prev->lru_next = node->lru_next;
+	else
+		cache->lru_head = node->lru_next;
 
-	model_params.split_mode = LLAMA_SPLIT_MODE_LAYER;
+	if (node->lru_next)
+		node->lru_next->lru_prev = node->lru_prev;
+	else
+		cache->lru_tail = node->lru_prev;
 
-	model_params.n_gpu_layers = 0;
-	if (!(model = llama_model_load_from_file(
-			path,
-			model_params)))
-		return NULL;
+	node->lru_prev = node->lru_next = NULL;
+}
+
+static void
+qllm_cache_lru_push(struct qllm_cache *cache, struct qllm_cache_node *node)
+{
+	node->lru_prev = NULL;
+	node->lru_next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = node;
+	else
+		cache->lru_tail = node;
+	cache->lru_head = node;
+}
+
+static void
+qllm_cache_touch(struct qllm_cache *cache, struct qllm_cache_node *node)
+{
+	qllm_cache_lru_unlink(cache, node);
+	qllm_cache_lru_push(cache, node);
+}
+
+/* Remove stateless leaves, walking up towards the root. */
+static void
+qllm_cache_prune(struct qllm_cache *cache, struct qllm_cache_node *node)
+{
+	struct qllm_cache_node **link, *parent;
+
+	while (node != &cache->root && !node->state && !node->child) {
+		parent = node->parent;
+
+		for (link = &parent->child; *link != node; link = &(*link)->next)
+			;
+		*link = node->next;
+
+		cache->used -= (size_t)node->n_edge * sizeof(*node->edge);
+		free(node->edge);
+		free(node);
+		node = parent;
+	}
+}
+
+/* Drop least recently used states until we are within budget. */
+static void
+qllm_cache_evict(struct qllm_cache *cache, struct qllm_cache_node *keep)
+{
+	struct qllm_cache_node *node;
+
+	while (cache->used > cache->max_bytes
+	       && cache->lru_tail && cache->lru_tail != keep) {
+		node = cache->lru_tail;
+		qllm_cache_lru_unlink(cache, node);
+		cache->used -= node->state_size;
+		free(node->state);
+		node->state = NULL;
+		node->state_size = 0;
+		qllm_cache_prune(cache, node);
+	}
+}
+
+static struct qllm_cache_node *
+qllm_cache_child(struct qllm_cache_node *node, llama_token tok)
+{
+	struct qllm_cache_node *child;
+
+	for (child = node->child; child; child = child->next)
+		if (child->edge[0] == tok)
+			return child;
+
+	return NULL;
+}
+
+/* Any state-holding node in the subtree, preferring `node` itself. */
+static struct qllm_cache_node *
+qllm_cache_any_state(struct qllm_cache_node *node)
+{
+	struct qllm_cache_node *child, *found;
+
+	if (node->state)
+		return node;
+
+	for (child = node->child; child; child = child->next)
+		if ((found = qllm_cache_any_state(child)))
+			return found;
+
+	return NULL;
+}
+
+/*
+ * Find a state covering the longest prefix of `tokens`.
+ * Stores the usable prefix length in *n_match.
+ */
+static struct qllm_cache_node *
+qllm_cache_match(struct qllm_cache *cache,
+		 const llama_token *tokens,
+		 int32_t n_tokens,
+		 int32_t *n_match)
+{
+	struct qllm_cache_node *node = &cache->root, *best = NULL;
+	struct qllm_cache_node *child, *found;
+	int32_t m = 0, i;
+
+	*n_match = 0;
+
+	while (m < n_tokens) {
+		if (node->state) {
+			best = node;
+			*n_match = node->depth;
+		}
+
+		child = qllm_cache_child(node, tokens[m]);
+		if (!child)
+			break;
+
+		for (i = 0; i < child->n_edge && m + i < n_tokens
+		     && child->edge[i] == tokens[m + i]; i++)
+			;
+
+		m += i;
+		node = child;
+
+		if (i < child->n_edge)
+			break;
+	}
+
+	if (m <= *n_match)
+		return best;
+
+	/* Every state below the divergence point covers all m tokens. */
+	found = qllm_cache_any_state(node);
+	if (found) {
+		best = found;
+		*n_match = m;
+	}
+
+	return best;
+}
+
+/* Walk (and build) the path for `tokens`, splitting edges as needed. */
+static struct qllm_cache_node *
+qllm_cache_path(struct qllm_cache *cache,
+		const llama_token *tokens,
+		int32_t n_tokens)
+{
+	struct qllm_cache_node *node = &cache->root, *child, *mid;
+	struct qllm_cache_node **link;
+	int32_t m = 0, i;
+
+	while (m < n_tokens) {
+		child = qllm_cache_child(node, tokens[m]);
+
+		if (!child) {
+			child = calloc(1, sizeof(*child));
+			if (!child)
+				return NULL;
+
+			child->n_edge = n_tokens - m;
+			child->edge = malloc((size_t)child->n_edge
+			    * sizeof(*child->edge));
+			if (!child->edge) {
+				free(child);
+				return NULL;
+			}
+
+			memcpy(child->edge, tokens + m,
+			    (size_t)child->n_edge * sizeof(*child->edge));
+			child->depth = n_tokens;
+			child->parent = node;
+			child->next = node->child;
+			node->child = child;
+			cache->used += (size_t)child->n_edge
+			    * sizeof(*child->edge);
+			return child;
+		}
+
+		for (i = 0; i < child->n_edge && m + i < n_tokens
+		     && child->edge[i] == tokens[m + i]; i++)
+			;
+
+		if (i < child->n_edge) {
+			mid = calloc(1, sizeof(*mid));
+			if (!mid)
+				return NULL;
+
+			mid->edge = malloc((size_t)i * sizeof(*mid->edge));
+			if (!mid->edge) {
+				free(mid);
+				return NULL;
+			}
+
+			memcpy(mid->edge, child->edge,
+			    (size_t)i * sizeof(*mid->edge));
+			mid->n_edge = i;
+			mid->depth = node->depth + i;
+			mid->parent = node;
+
+			for (link = &node->child; *link != child;
+			     link = &(*link)->next)
+				;
+			*link = mid;
+			mid->next = child->next;
+			mid->child = child;
+
+			memmove(child->edge, child->edge + i,
+			    (size_t)(child->n_edge - i)
+			    * sizeof(*child->edge));
+			child->n_edge -= i;
+			child->next = NULL;
+			child->parent = mid;
+			child = mid;
+		}
+
+		m += child->n_edge;
+		node = child;
+	}
+
+	return node;
+}
+
+/*
+ * Seed the KV cache from the prefix cache if it covers more than the
+ * `n_keep` tokens we already have. Returns the tokens now in the cache.
+ */
+static int32_t
+qllm_cache_restore(struct qllm_context *qctx,
+		   const llama_token *tokens,
+		   int32_t n_tokens,
+		   int32_t n_keep)
+{
+	struct qllm_cache *cache = qctx->cache;
+	llama_memory_t mem = llama_get_memory(qctx->ctx);
+	struct qllm_cache_node *node;
+	int32_t n_match;
+	uint64_t t0;
+	size_t ret;
+
+	if (!cache || n_tokens - 1 < QLLM_CACHE_MIN_TOKENS)
+		return n_keep;
+
+	pthread_mutex_lock(&cache->lock);
+
+	if (!cache->model || cache->model->model != qctx->model) {
+		pthread_mutex_unlock(&cache->lock);
+		return n_keep;
+	}
+
+	node = qllm_cache_match(cache, tokens, n_tokens, &n_match);
+
+	/* Leave at least one token to decode so fresh logits exist. */
+	if (n_match > n_tokens - 1)
+		n_match = n_tokens - 1;
+
+	if (!node || n_match <= n_keep || n_match < QLLM_CACHE_MIN_TOKENS) {
+		pthread_mutex_unlock(&cache->lock);
+		return n_keep;
+	}
+
+	qllm_cache_touch(cache, node);
+	t0 = QLLM_TRACE_T0();
+	llama_memory_seq_rm(mem, qctx->seq_id, -1, -1);
+	ret = llama_state_seq_set_data(qctx->ctx, node->state,
+	    node->state_size, qctx->seq_id);
+	pthread_mutex_unlock(&cache->lock);
+	QLLM_TRACE("cache_restore", t0, qllm_now_ns(), n_match);
+
+	if (!ret || !llama_memory_seq_rm(mem, qctx->seq_id, n_match, -1)) {
+		llama_memory_seq_rm(mem, qctx->seq_id, -1, -1);
+		qctx->cur_pos = 0;
+		return 0;
+	}
+
+	memcpy(qctx->token_buf, tokens, (size_t)n_match * sizeof(*tokens));
+	qctx->cur_pos = n_match;
+	return n_match;
+}
+
+/* Save the current KV state unless the cache already covers it. */
+static void
+qllm_cache_store(struct qllm_context *qctx)
+{
+	struct qllm_cache *cache = qctx->cache;
+	struct qllm_cache_node *node;
+	int32_t n_match;
+	uint8_t *state;
+	size_t size;
+
+	/* A shifted context no longer matches a plain prefill. */
+	if (!cache || qctx->shifted || qctx->cur_pos < QLLM_CACHE_MIN_TOKENS)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+
+	if (!cache->model) {
+		struct qllm_context *owner = qctx->owner ? qctx->owner : qctx;
+
+		cache->model = qllm_model_retain(owner);
+	}
+
+	if (!cache->model || cache->model->model != qctx->model) {
+		pthread_mutex_unlock(&cache->lock);
+		return;
+	}
+
+	node = qllm_cache_match(cache, qctx->token_buf, qctx->cur_pos,
+	    &n_match);
+	if (node && n_match == qctx->cur_pos) {
+		qllm_cache_touch(cache, node);
+		pthread_mutex_unlock(&cache->lock);
+		return;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	size = llama_state_seq_get_size(qctx->ctx, qctx->seq_id);
+	if (!size || size > cache->max_bytes)
+		return;
+
+	state = malloc(size);
+	if (!state)
+		return;
+
+	if (llama_state_seq_get_data(qctx->ctx, state, size,
+	    qctx->seq_id) != size) {
+		free(state);
+		return;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+
+	node = qllm_cache_path(cache, qctx->token_buf, qctx->cur_pos);
+	if (!node) {
+		pthread_mutex_unlock(&cache->lock);
+		free(state);
+		return;
+	}
+
+	if (node->state) {
+		qllm_cache_lru_unlink(cache, node);
+		cache->used -= node->state_size;
+		free(node->state);
+	}
+
+	node->state = state;
+	node->state_size = size;
+	cache->used += size;
+	qllm_cache_lru_push(cache, node);
+	qllm_cache_evict(cache, node);
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* llama_tokenize() with special tokens parsed, counted in qctx. */
+static int32_t
+qllm_tokenize_run(struct qllm_context *qctx,
+		  const char *text,
+		  llama_token *out,
+		  int32_t n_max,
+		  int add_special)
+{
+	uint64_t t0 = qllm_now_ns(), t1;
+	int32_t n;
+
+	n = llama_tokenize(qctx->vocab,
+			   text,
+			   (int32_t) strlen(text),
+			   out,
+			   n_max,
+			   add_special != 0,
+			   true);
+
+	t1 = qllm_now_ns();
+	qctx->stats.t_tokenize_ns += t1 - t0;
+	QLLM_TRACE("tokenize", t0, t1, n);
+	if (n > 0)
+		qctx->stats.n_tokenized += (uint64_t) n;
+	return n;
+}
+
+/* Tokenize text into prompt_buf. Returns the token count or -1. */
+static int32_t
+qllm_tokenize_prompt(struct qllm_context *qctx, const char *text)
+{
+	return qllm_tokenize_run(qctx, text, qctx->prompt_buf,
+	    qctx->max_tokens, 1);
+}
+
+/*
+ * Bring the KV cache to hold exactly `tokens`: keep the prefix it
+ * shares with token_buf, drop the rest and decode only the new suffix.
+ */
+static int
+qllm_sync_tokens(struct qllm_context *qctx,
+		 const llama_token *tokens,
+		 int32_t n_tokens)
+{
+	llama_memory_t mem = llama_get_memory(qctx->ctx);
+	int32_t n_keep = 0;
+
+	while (n_keep < n_tokens && n_keep < qctx->cur_pos
+	       && qctx->token_buf[n_keep] == tokens[n_keep])
+		n_keep++;
+
+	/* Always decode at least one token so fresh logits exist. */
+	if (n_keep == n_tokens)
+		n_keep--;
+
+	if (n_keep < qctx->cur_pos) {
+		if (!llama_memory_seq_rm(mem, qctx->seq_id, n_keep, -1)) {
+			/* Partial removal unsupported (recurrent models). */
+			llama_memory_seq_rm(mem, qctx->seq_id, -1, -1);
+			n_keep = 0;
+		}
+		qctx->cur_pos = n_keep;
+		qllm_lookup_trim(qctx, n_keep);
+		if (n_keep <= qctx->n_keep)
+			qctx->shifted = 0;
+		qctx->stats.n_reinit++;
+	}
+
+	n_keep = qllm_cache_restore(qctx, tokens, n_tokens, n_keep);
+	qctx->stats.n_reused += (uint64_t) n_keep;
+	qctx->stats.n_prefilled += (uint64_t) (n_tokens - n_keep);
+
+	if (qllm_decode_tokens(qctx, tokens + n_keep, n_tokens - n_keep) != 0)
+		return -1;
+
+	qllm_cache_store(qctx);
+	return 0;
+}
+
+extern void
+qllm_backend_mem_check(int gpu, size_t *free_b, size_t *total_b);
+
+extern char *
+qllm_schema_gbnf(const char *schema);
+
+/*
+ * What we need to know about a model before loading it, read from the
+ * GGUF header in one pass.
+ */
+struct qllm_meta {
+	int32_t		 n_layers;	/* <arch>.block_count */
+	int32_t		 n_embd;	/* <arch>.embedding_length */
+	int32_t		 n_head;	/* <arch>.attention.head_count */
+	int32_t		 n_head_kv;	/* <arch>.attention.head_count_kv */
+	int32_t		 head_k;	/* <arch>.attention.key_length */
+	int32_t		 head_v;	/* <arch>.attention.value_length */
+	int32_t		 n_ff;		/* <arch>.feed_forward_length */
+	int32_t		 n_vocab;	/* tokenizer.ggml.tokens */
+	size_t		*layer_sizes;	/* weight bytes per layer */
+	size_t		 weights;	/* all weight bytes */
+};
+
+/* Integer metadata value; arrays (per-layer values) give their max. */
+static int64_t
+gguf_get_int(const struct gguf_context *ctx, const char *arch,
+	     const char *key)
+{
+	char name[128];
+	int64_t id, v = -1;
+	size_t i, n;
+	const void *data;
+
+	snprintf(name, sizeof(name), "%s.%s", arch, key);
+	id = gguf_find_key(ctx, name);
+	if (id < 0)
+		return -1;
+
+	switch (gguf_get_kv_type(ctx, id)) {
+	case GGUF_TYPE_UINT32:
+		return gguf_get_val_u32(ctx, id);
+	case GGUF_TYPE_INT32:
+		return gguf_get_val_i32(ctx, id);
+	case GGUF_TYPE_UINT64:
+		return (int64_t)gguf_get_val_u64(ctx, id);
+	case GGUF_TYPE_ARRAY:
+		n = gguf_get_arr_n(ctx, id);
+		data = gguf_get_arr_data(ctx, id);
+		for (i = 0; i < n; i++) {
+			int64_t e;
+
+			switch (gguf_get_arr_type(ctx, id)) {
+			case GGUF_TYPE_UINT32:
+				e = ((const uint32_t *)data)[i];
+				break;
+			case GGUF_TYPE_INT32:
+				e = ((const int32_t *)data)[i];
+				break;
+			default:
+				return -1;
+			}
+
+			if (e > v)
+				v = e;
+		}
+		return v;
+	default:
+		return -1;
+	}
+}
+
+static void
+qllm_meta_free(struct qllm_meta *meta)
+{
+	free(meta->layer_sizes);
+	meta->layer_sizes = NULL;
+}
+
+static int
+qllm_meta_read(const char *path, struct qllm_meta *meta)
+{
+	struct gguf_init_params ip = { .no_alloc = true };
+	struct gguf_context *ctx;
+	const char *arch;
+	int64_t id;
+	int n_tensors;
+	int i;
+
+	memset(meta, 0, sizeof(*meta));
+
+	ctx = gguf_init_from_file(path, ip);
+	if (!ctx)
+		return -1;
+
+	id = gguf_find_key(ctx, "general.architecture");
+	arch = id >= 0 ? gguf_get_val_str(ctx, id) : NULL;
+	if (!arch) {
+		gguf_free(ctx);
+		return -1;
+	}
+
+	meta->n_layers = (int32_t)gguf_get_int(ctx, arch, "block_count");
+	meta->n_embd = (int32_t)gguf_get_int(ctx, arch, "embedding_length");
+	meta->n_head = (int32_t)gguf_get_int(ctx, arch,
+	    "attention.head_count");
+	meta->n_head_kv = (int32_t)gguf_get_int(ctx, arch,
+	    "attention.head_count_kv");
+	meta->head_k = (int32_t)gguf_get_int(ctx, arch,
+	    "attention.key_length");
+	meta->head_v = (int32_t)gguf_get_int(ctx, arch,
+	    "attention.value_length");
+	meta->n_ff = (int32_t)gguf_get_int(ctx, arch, "feed_forward_length");
+	id = gguf_find_key(ctx, "tokenizer.ggml.tokens");
+	meta->n_vocab = id >= 0 ? (int32_t)gguf_get_arr_n(ctx, id) : 0;
+
+	n_tensors = (int)gguf_get_n_tensors(ctx);
+	if (meta->n_layers <= 0 || meta->n_embd <= 0 || n_tensors <= 0) {
+		gguf_free(ctx);
+		return -1;
+	}
+
+	/* Heads split the embedding unless the model says otherwise. */
+	if (meta->n_head <= 0)
+		meta->n_head = meta->n_head_kv > 0 ? meta->n_head_kv : 1;
+	if (meta->n_head_kv <= 0)
+		meta->n_head_kv = meta->n_head;
+	if (meta->head_k <= 0)
+		meta->head_k = meta->n_embd / meta->n_head;
+	if (meta->head_v <= 0)
+		meta->head_v = meta->head_k;
+	if (meta->n_ff <= 0)
+		meta->n_ff = 4 * meta->n_embd;
+
+	meta->layer_sizes = calloc((size_t)meta->n_layers,
+	    sizeof(*meta->layer_sizes));
+	if (!meta->layer_sizes) {
+		gguf_free(ctx);
+		return -1;
+	}
+
+	for (i = 0; i < n_tensors; i++) {
+		const char *name = gguf_get_tensor_name(ctx, i);
+		const char *p;
+		long layer;
+
+		if (!name)
+			continue;
+
+		meta->weights += gguf_get_tensor_size(ctx, i);
+
+		p = strstr(name, "blk.");
+		if (!p) p = strstr(name, "layers.");
+		if (!p) p = strstr(name, "block.");
+		if (!p)
+			continue;
+
+		while (*p && !isdigit((unsigned char)*p))
+			p++;
+		if (!isdigit((unsigned char)*p))
+			continue;
+
+		layer = strtol(p, NULL, 10);
+		if (layer < 0 || layer >= meta->n_layers)
+			continue;
+
+		meta->layer_sizes[layer] += gguf_get_tensor_size(ctx, i);
+	}
+
+	gguf_free(ctx);
+	return 0;
+}
+
+/*
+ * KV cache bytes per token over n_layers layers: keys and values of
+ * every KV head, in the cache's type (blocks of 32 for the quantized
+ * ones).
+ */
+static size_t
+qllm_kv_token_bytes(const struct qllm_meta *meta, enum qllm_kv_type type,
+		    int32_t n_layers)
+{
+	size_t elems, per32;
+
+	elems = (size_t)n_layers * (size_t)meta->n_head_kv
+	    * (size_t)(meta->head_k + meta->head_v);
+
+	switch (type) {
+	case QLLM_KV_Q8_0:
+		per32 = 34;
+		break;
+	case QLLM_KV_Q4_0:
+		per32 = 18;
+		break;
+	default:
+		per32 = 64;
+		break;
+	}
+
+	return (elems * per32 + 31) / 32;
+}
+
+static int
+auto_ngl(const struct qllm_meta *meta, int gpu, uint32_t n_ctx,
+	 uint32_t max_offload_bytes, int n_contexts)
+{
+	size_t free_b, total_b;
+	size_t usable;
+	size_t kv_size_per_ctx;
+	size_t workspace_per_ctx;
+	size_t this_ctx_cost;
+	size_t per_other_ctx_cost = 0;
+	size_t other_ctx_cost = 0;
+	size_t system_overhead;
+	size_t reserve;
+	size_t used;
+	size_t largest_layer;
+	int n_layers = meta->n_layers;
+	int ngl;
+	int i;
+
+	if (n_contexts <= 0)
+		n_contexts = 1;
+
+	qllm_backend_mem_check(gpu, &free_b, &total_b);
+	if (!total_b || !free_b)
+		return 0;
+
+	usable = free_b;
+	if (!usable)
+		return 0;
+
+	largest_layer = 0;
+	for (i = 0; i < n_layers; i++)
+		if (meta->layer_sizes[i] > largest_layer)
+			largest_layer = meta->layer_sizes[i];
+
+	workspace_per_ctx = largest_layer + (64 * 1024 * 1024);
+
+	kv_size_per_ctx = (size_t)n_ctx
+	    * qllm_kv_token_bytes(meta, QLLM_KV_F16, n_layers);
+
+	system_overhead = kv_size_per_ctx / 10;
+
+	this_ctx_cost = kv_size_per_ctx + workspace_per_ctx;
+
+	if (n_contexts > 1) {
+		per_other_ctx_cost = this_ctx_cost + (this_ctx_cost >> 1);
+		other_ctx_cost = per_other_ctx_cost * (size_t)(n_contexts - 1);
+	}
+
+	/* reserva fixa para driver/SO */
+	reserve = 128 * 1024 * 1024ULL;
+
+	if (usable <= reserve + this_ctx_cost + other_ctx_cost + system_overhead)
+		return 0;
+
+	usable -= reserve;
+	usable -= this_ctx_cost + other_ctx_cost + system_overhead;
+
+	if (max_offload_bytes > 0 && usable > max_offload_bytes)
+		usable = max_offload_bytes;
+
+	used = 0;
+	ngl = 0;
+
+	for (i = 0; i < n_layers; i++) {
+		size_t weight = meta->layer_sizes[i];
+		size_t need   = weight * 5 / 2;
+
+		if (used + need > usable)
+			break;
+
+		used += need;
+		ngl++;
+	}
+
+	return ngl;
+}
+
+/* A "Key:   N kB" line of /proc/meminfo, in bytes; 0 if missing. */
+static uint64_t
+meminfo_get(const char *key)
+{
+	char line[256];
+	size_t n = strlen(key);
+	uint64_t v = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/meminfo", "r");
+	if (!fp)
+		return 0;
+
+	while (fgets(line, sizeof(line), fp))
+		if (!strncmp(line, key, n) && line[n] == ':') {
+			v = strtoull(line + n + 1, NULL, 10) * 1024;
+			break;
+		}
+
+	fclose(fp);
+	return v;
+}
+
+/* First number in a file; 0 if missing or "max". */
+static uint64_t
+file_u64(const char *path)
+{
+	char buf[64];
+	uint64_t v = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+
+	if (fgets(buf, sizeof(buf), fp) && isdigit((unsigned char) *buf))
+		v = strtoull(buf, NULL, 10);
+
+	fclose(fp);
+	return v;
+}
+
+/* dir + rel + "/" + file into buf; -1 if it does not fit. */
+static int
+cgroup_path(char *buf, size_t size, const char *dir, const char *rel,
+	    const char *file)
+{
+	int n = snprintf(buf, size, "%s%s/%s", dir, rel, file);
+
+	return n < 0 || (size_t) n >= size ? -1 : 0;
+}
+
+/*
+ * What our memory cgroup still lets us allocate, or 0 with no limit.
+ * v2 first (memory.max), then v1 (memory.limit_in_bytes), each at the
+ * process's own cgroup path, then at the mount root as containers
+ * tend to see it. A path that gets cut short counts as no limit.
+ */
+static uint64_t
+cgroup_avail(void)
+{
+	static const char *v2[] = { "/sys/fs/cgroup", "memory.max",
+		"memory.current" };
+	static const char *v1[] = { "/sys/fs/cgroup/memory",
+		"memory.limit_in_bytes", "memory.usage_in_bytes" };
+	const char **ver[] = { v2, v1 };
+	char line[512], rel[2][sizeof(line)] = { "", "" };
+	char path[sizeof(line) + 64], *p;
+	uint64_t limit, used;
+	size_t v, k;
+	int bad = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/cgroup", "r");
+	if (fp) {
+		while (fgets(line, sizeof(line), fp)) {
+			/* A path too long to read whole can't be trusted. */
+			if (!(p = strchr(line, '\n'))) {
+				bad = !feof(fp);
+				if (bad)
+					break;
+			} else
+				*p = '\0';
+
+			if (!strncmp(line, "0::", 3))
+				snprintf(rel[0], sizeof(rel[0]), "%s", line + 3);
+			else if ((p = strstr(line, ":memory:")))
+				snprintf(rel[1], sizeof(rel[1]), "%s", p + 8);
+		}
+		fclose(fp);
+	}
+
+	if (bad)
+		return 0;
+
+	for (v = 0; v < 2; v++)
+		for (k = 0; k < 2; k++) {
+			if (cgroup_path(path, sizeof(path), ver[v][0],
+			    k ? "" : rel[v], ver[v][1]) < 0)
+				return 0;
+			limit = file_u64(path);
+			/* v1 says "no limit" with a huge number */
+			if (!limit || limit >= (1ULL << 60))
+				continue;
+
+			if (cgroup_path(path, sizeof(path), ver[v][0],
+			    k ? "" : rel[v], ver[v][2]) < 0)
+				return 0;
+			used = file_u64(path);
+			return limit > used ? limit - used : 1;
+		}
+
+	return 0;
+}
+
+/* Host RAM we may still use, or 0 if unknown. */
+static uint64_t
+host_avail(void)
+{
+	uint64_t avail = meminfo_get("MemAvailable"), cg = cgroup_avail();
+
+	if (cg && (!avail || cg < avail))
+		avail = cg;
+
+	return avail;
+}
+
+/*
+ * Graph scratch of the plan's contexts. llama.cpp sizes it for one
+ * ubatch through one layer at a time: the residual stream, norms and
+ * attention output (n_embd each), the FFN (n_ff, gate and up), the
+ * attention scores over a sequence's span, and the logits, all f32.
+ * Flash attention, llama's default, keeps the scores to one
+ * sequence's span rather than every cell of the KV cache.
+ */
+static uint64_t
+qllm_plan_compute(const struct qllm_meta *meta,
+		  const struct qllm_config *cfg,
+		  const struct qllm_plan *plan)
+{
+	uint64_t n_kv, n_batch, ub;
+
+	n_kv = (uint64_t) plan->n_ctx * (uint64_t) plan->n_seq_max;
+	n_batch = cfg->n_batch > 0 && (uint64_t) cfg->n_batch < n_kv
+	    ? (uint64_t) cfg->n_batch : n_kv;
+
+	/* As qllm_create() sets it: embeddings need the whole batch. */
+	ub = n_batch;
+	if (cfg->mode == QLLM_MODE_GENERATE) {
+		ub = cfg->n_ubatch > 0 ? (uint64_t) cfg->n_ubatch
+		    : QLLM_N_UBATCH;
+		if (ub > n_batch)
+			ub = n_batch;
+	}
+
+	return (uint64_t) plan->n_contexts * 4 * ub
+	    * (3 * (uint64_t) meta->n_embd + 2 * (uint64_t) meta->n_ff
+	    + (uint64_t) meta->n_head * (uint64_t) plan->n_ctx
+	    + (uint64_t) meta->n_vocab);
+}
+
+int
+qllm_plan(const struct qllm_config *cfg, struct qllm_plan *plan)
+{
+	static const enum qllm_kv_type types[] = {
+		QLLM_KV_F16, QLLM_KV_Q8_0, QLLM_KV_Q4_0,
+	};
+	struct qllm_meta meta;
+	uint64_t fixed, kv, reserve;
+	int32_t n_host_layers, n_seqs, i;
+	size_t t;
+
+	if (!cfg || !cfg->model_path || !plan)
+		return -1;
+
+	memset(plan, 0, sizeof(*plan));
+	plan->n_ctx = cfg->n_ctx > 0 ? cfg->n_ctx : QLLM_N_CTX;
+	plan->n_seq_max = cfg->n_seq_max > 1 ? cfg->n_seq_max
+	    : cfg->mode == QLLM_MODE_EMBED && cfg->n_seq_max <= 0
+	    ? QLLM_EMBED_SEQS : 1;
+	plan->n_contexts = cfg->n_contexts > 0 ? cfg->n_contexts : 1;
+	plan->kv_type = cfg->kv_type;
+
+	if (qllm_meta_read(cfg->model_path, &meta) != 0)
+		return -1;
+
+	/* As model_load() would offload; those layers leave host RAM. */
+	plan->n_gpu_layers = auto_ngl(&meta, 0,
+	    (uint32_t)(plan->n_ctx * plan->n_seq_max),
+	    cfg->max_offload_bytes, plan->n_contexts);
+	n_host_layers = meta.n_layers - plan->n_gpu_layers;
+
+	plan->weights_bytes = meta.weights;
+	for (i = n_host_layers; i < meta.n_layers; i++)
+		plan->weights_bytes -= meta.layer_sizes[i];
+
+	plan->compute_bytes = qllm_plan_compute(&meta, cfg, plan);
+
+	plan->host_avail = host_avail();
+	if (!plan->host_avail) {
+		/* Nothing to plan against: take the request as it is. */
+		plan->kv_bytes = (uint64_t) plan->n_contexts * plan->n_seq_max
+		    * plan->n_ctx * qllm_kv_token_bytes(&meta, plan->kv_type,
+		    n_host_layers);
+		qllm_meta_free(&meta);
+		return 0;
+	}
+
+	reserve = plan->host_avail / 20;
+	if (reserve < (256ULL << 20))
+		reserve = 256ULL << 20;
+	plan->host_budget = plan->host_avail > reserve
+	    ? plan->host_avail - reserve : 0;
+
+	/*
+	 * Keep what was asked for if it fits, at the requested KV type
+	 * or a smaller one; then give up sequences, then contexts, then
+	 * halve the context down to QLLM_PLAN_MIN_CTX.
+	 */
+	for (;;) {
+		n_seqs = plan->n_contexts * plan->n_seq_max;
+		plan->compute_bytes = qllm_plan_compute(&meta, cfg, plan);
+		fixed = plan->weights_bytes + plan->compute_bytes;
+
+		for (t = 0; t < sizeof(types) / sizeof(*types); t++) {
+			/* q4_0 costs quality: only when asked for. */
+			if (types[t] < cfg->kv_type
+			    || (types[t] == QLLM_KV_Q4_0
+			    && cfg->kv_type != QLLM_KV_Q4_0))
+				continue;
+
+			kv = (uint64_t) n_seqs * plan->n_ctx
+			    * qllm_kv_token_bytes(&meta, types[t],
+			    n_host_layers);
+			if (fixed + kv <= plan->host_budget) {
+				plan->kv_type = types[t];
+				plan->kv_bytes = kv;
+				qllm_meta_free(&meta);
+				return 0;
+			}
+		}
+
+		plan->downsized = 1;
+		if (plan->n_seq_max > 1)
+			plan->n_seq_max--;
+		else if (plan->n_contexts > 1)
+			plan->n_contexts--;
+		else if (plan->n_ctx / 2 >= QLLM_PLAN_MIN_CTX)
+			plan->n_ctx /= 2;
+		else
+			break;
+	}
+
+	/* Not even one small context fits. */
+	plan->kv_type = cfg->kv_type > QLLM_KV_Q8_0
+	    ? cfg->kv_type : QLLM_KV_Q8_0;
+	plan->kv_bytes = (uint64_t) plan->n_ctx
+	    * qllm_kv_token_bytes(&meta, plan->kv_type, n_host_layers);
+	qllm_meta_free(&meta);
+	return -1;
+}
+
+int
+qllm_plan_print(const struct qllm_plan *plan, char *buf, size_t size)
+{
+	static const char *types[] = { "f16", "q8_0", "q4_0" };
+
+	if (!plan || !buf)
+		return -1;
+
+	return snprintf(buf, size, "n_ctx %d x %d sequence(s) x %d "
+	    "context(s), KV %s, %d GPU layer(s); host RAM: weights %llu MiB"
+	    " + KV %llu MiB + compute %llu MiB of %llu MiB budget "
+	    "(%llu MiB available)%s",
+	    plan->n_ctx, plan->n_seq_max, plan->n_contexts,
+	    types[plan->kv_type <= QLLM_KV_Q4_0 ? plan->kv_type : 0],
+	    plan->n_gpu_layers,
+	    (unsigned long long) (plan->weights_bytes >> 20),
+	    (unsigned long long) (plan->kv_bytes >> 20),
+	    (unsigned long long) (plan->compute_bytes >> 20),
+	    (unsigned long long) (plan->host_budget >> 20),
+	    (unsigned long long) (plan->host_avail >> 20),
+	    plan->downsized ? ", downsized" : "");
+}
+
+/*
+ * Render every token of the vocabulary once, into one arena, so
+ * emitting a token is a lookup rather than a trip through llama.
+ */
+static int
+qllm_pieces_build(struct qllm_model *entry)
+{
+	const struct llama_vocab *vocab = llama_model_get_vocab(entry->model);
+	size_t len = 0, cap = 1 << 20;
+	char *arena, *p;
+	int32_t i;
+	int n;
+
+	entry->n_vocab = llama_vocab_n_tokens(vocab);
+	entry->piece_max = QLLM_PIECE_MAX;
+	entry->piece_off = malloc(((size_t) entry->n_vocab + 1)
+	    * sizeof(*entry->piece_off));
+	arena = malloc(cap);
+	if (!entry->piece_off || !arena)
+		goto fail;
+
+	for (i = 0; i < entry->n_vocab; i++) {
+		entry->piece_off[i] = (uint32_t) len;
+		for (;;) {
+			n = llama_token_to_piece(vocab,
+						 i,
+						 arena + len,
+						 (int32_t) (cap - len),
+						 false,
+						 true);
+			if (n >= 0)
+				break;
+
+			/* Negative: bytes it needs. */
+			while (cap - len < (size_t) -n)
+				cap *= 2;
+			p = realloc(arena, cap);
+			if (!p)
+				goto fail;
+			arena = p;
+		}
+
+		len += (size_t) n;
+		if ((size_t) n > entry->piece_max)
+			entry->piece_max = (size_t) n;
+	}
+
+	entry->piece_off[i] = (uint32_t) len;
+	entry->pieces = realloc(arena, len ? len : 1);
+	if (!entry->pieces)
+		entry->pieces = arena;
+	return 0;
+
+fail:
+	free(arena);
+	free(entry->piece_off);
+	entry->piece_off = NULL;
+	return -1;
+}
+
+/*
+ * Find the registry entry for path, or load the weights (once) and
+ * register them. Returns a new reference.
+ */
+static struct qllm_model *
+model_load(const char *path,
+	   int32_t n_ctx,
+	   uint32_t ngl_max,
+	   int32_t n_contexts)
+{
+	struct llama_model_params model_params;
+	struct qllm_model **entry_r, *entry;
+	struct llama_model *model;
+	struct qllm_meta meta;
+	int ngl = 0;
+
+	pthread_mutex_lock(&model_lock);
+
+	entry_r = (struct qllm_model **) qmap_get(model_hd, path);
+	if (entry_r) {
+		entry = *entry_r;
+		entry->refs++;
+		pthread_mutex_unlock(&model_lock);
+		return entry;
+	}
+
+	if (!n_contexts)
+		n_contexts = 1;
+
+	model_params = llama_model_default_params();
+
+	model_params.split_mode = LLAMA_SPLIT_MODE_LAYER;
+
+	/* Plan offload from the header alone; load the weights once. */
+	if (qllm_meta_read(path, &meta) == 0) {
+		ngl = auto_ngl(&meta, 0, n_ctx, ngl_max, n_contexts);
+		qllm_meta_free(&meta);
+	}
+
+	if (ngl > 0)
+		model_params.n_gpu_layers = ngl;
+	else
+		model_params.n_gpu_layers = 0;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		goto fail;
+
+	entry->path = strdup(path);
+	if (!entry->path)
+		goto fail;
+
+	if (!(model = llama_model_load_from_file(
+			path,
+			model_params)))
+		goto fail;
+
+	entry->model = model;
+	if (qllm_pieces_build(entry) != 0) {
+		llama_model_free(model);
+		goto fail;
+	}
+
+	entry->refs = 1;
+	qmap_put(model_hd, path, &entry);
+
+	pthread_mutex_unlock(&model_lock);
+	return entry;
+
+fail:
+	pthread_mutex_unlock(&model_lock);
+	if (entry)
+		free(entry->path);
+	free(entry);
+	return NULL;
+}
+
+struct qllm_model *
+qllm_model_retain(struct qllm_context *qctx)
+{
+	struct qllm_model *entry;
+
+	if (!qctx)
+		return NULL;
+
+	entry = qctx->owner ? qctx->owner->entry : qctx->entry;
+	if (!entry)
+		return NULL;
+
+	pthread_mutex_lock(&model_lock);
+	entry->refs++;
+	pthread_mutex_unlock(&model_lock);
+	return entry;
+}
+
+void
+qllm_model_release(struct qllm_model *entry)
+{
+	if (!entry)
+		return;
+
+	pthread_mutex_lock(&model_lock);
+
+	if (--entry->refs) {
+		pthread_mutex_unlock(&model_lock);
+		return;
+	}
+
+	qmap_del(model_hd, entry->path);
+	pthread_mutex_unlock(&model_lock);
+
+	llama_model_free(entry->model);
+	free(entry->pieces);
+	free(entry->piece_off);
+	free(entry->path);
+	free(entry);
+}
+
+/*
+ * Build the filter chain. Top-k runs first, on the raw logits, so the
+ * penalties, softmax and everything after it only see k candidates
+ * instead of the whole vocabulary. The draw itself is not part of it:
+ * qllm_draw() does that on our own RNG, so a grammar retry can reuse
+ * the random number of the first try.
+ */
+static struct llama_sampler *
+qllm_sampler_new(const struct qllm_sampling *sp)
+{
+	struct llama_sampler *chain;
+	int32_t top_k, last_n;
+
+	chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+	if (!chain)
+		return NULL;
+
+	top_k = sp->top_k ? sp->top_k : QLLM_TOP_K;
+	if (sp->temp <= 0.0f && !sp->top_k)
+		top_k = 0;	/* plain greedy needs no pruning */
+	if (top_k > 0)
+		llama_sampler_chain_add(chain, llama_sampler_init_top_k(top_k));
+
+	if ((sp->repeat_penalty > 0.0f && sp->repeat_penalty != 1.0f)
+	    || sp->presence_penalty != 0.0f || sp->freq_penalty != 0.0f) {
+		last_n = sp->penalty_last_n ? sp->penalty_last_n
+		    : QLLM_PENALTY_LAST_N;
+		llama_sampler_chain_add(chain,
+		    llama_sampler_init_penalties(last_n,
+		    sp->repeat_penalty > 0.0f ? sp->repeat_penalty : 1.0f,
+		    sp->freq_penalty, sp->presence_penalty));
+	}
+
+	if (sp->temp <= 0.0f)
+		return chain;
+
+	if (sp->top_p > 0.0f && sp->top_p < 1.0f)
+		llama_sampler_chain_add(chain,
+		    llama_sampler_init_top_p(sp->top_p, 1));
+	if (sp->min_p > 0.0f)
+		llama_sampler_chain_add(chain,
+		    llama_sampler_init_min_p(sp->min_p, 1));
+
+	llama_sampler_chain_add(chain, llama_sampler_init_temp(sp->temp));
+	return chain;
+}
+
+static void
+qllm_stop_free(struct qllm_stop *st)
+{
+	if (!st)
+		return;
+
+	free(st->next);
+	free(st->depth);
+	free(st->match);
+	free(st->tokens);
+	free(st->hold);
+	free(st);
+}
+
+/* Candidates for logits row idx: the whole vocabulary, unsorted. */
+static void
+qllm_cand_fill(struct qllm_context *qctx, int32_t idx,
+	       llama_token_data_array *cur)
+{
+	const float *logits = llama_get_logits_ith(qctx->ctx, idx);
+	llama_token i, n_vocab = llama_vocab_n_tokens(qctx->vocab);
+
+	for (i = 0; i < n_vocab; i++) {
+		qctx->cand[i].id = i;
+		qctx->cand[i].logit = logits[i];
+		qctx->cand[i].p = 0.0f;
+	}
+
+	cur->data = qctx->cand;
+	cur->size = (size_t) n_vocab;
+	cur->selected = -1;
+	cur->sorted = false;
+}
+
+/* Does the grammar allow tok next? One candidate, no vocabulary scan. */
+static int
+qllm_grammar_allows(struct qllm_context *qctx, llama_token tok)
+{
+	llama_token_data one = { tok, 1.0f, 0.0f };
+	llama_token_data_array cur = { &one, 1, -1, false };
+
+	llama_sampler_apply(qctx->grammar, &cur);
+	return one.logit != -INFINITY;
+}
+
+/* Seed the draw from the sampling settings, or at random if unset. */
+static void
+qllm_rng_seed(struct qllm_context *qctx)
+{
+	qctx->rng = qctx->sampling.seed ? qctx->sampling.seed
+	    : qllm_now_ns() ^ (uint64_t) (uintptr_t) qctx;
+}
+
+/* Next number in [0, 1), splitmix64. */
+static double
+qllm_rand(struct qllm_context *qctx)
+{
+	uint64_t z = (qctx->rng += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z ^= z >> 31;
+	return (double) (z >> 11) * 0x1.0p-53;
+}
+
+/*
+ * Draw from what the chain left in cur: the best logit if greedy,
+ * otherwise the softmax inverse at u. Returns -1 if every candidate
+ * is masked.
+ */
+static llama_token
+qllm_draw(llama_token_data_array *cur, int greedy, double u)
+{
+	float max = -INFINITY;
+	double sum = 0.0;
+	size_t i, best = 0;
+
+	for (i = 0; i < cur->size; i++)
+		if (cur->data[i].logit > max) {
+			max = cur->data[i].logit;
+			best = i;
+		}
+	if (max == -INFINITY)
+		return -1;
+
+	if (!greedy) {
+		for (i = 0; i < cur->size; i++) {
+			cur->data[i].p = cur->data[i].logit > -INFINITY
+			    ? expf(cur->data[i].logit - max) : 0.0f;
+			sum += cur->data[i].p;
+		}
+
+		sum *= u;
+		for (i = 0; i < cur->size; i++) {
+			if (cur->data[i].p <= 0.0f)
+				continue;
+			best = i;
+			sum -= cur->data[i].p;
+			if (sum < 0.0)
+				break;
+		}
+	}
+
+	cur->selected = (int64_t) best;
+	return cur->data[best].id;
+}
+
+/*
+ * Sample and accept the token for logits row idx. Each token takes
+ * exactly one random number, whatever the grammar does, so a seeded
+ * run draws the same numbers with or without one.
+ * With a grammar, the chain runs unconstrained and only the token it
+ * picks is checked, which is one grammar step. If that is rejected,
+ * the grammar masks just the few candidates the chain kept (top-k,
+ * top-p, min-p) and the draw is repeated among them. The whole
+ * vocabulary is masked only when none of those is allowed. llama keeps
+ * the grammar state to itself, so there is nothing to key a mask cache
+ * on; this keeps the full mask off the common path instead.
+ */
+static llama_token
+qllm_sample_pick(struct qllm_context *qctx, int32_t idx)
+{
+	llama_token_data_array cur;
+	int greedy = qctx->sampling.temp <= 0.0f;
+	double u = greedy ? 0.0 : qllm_rand(qctx);
+	llama_token tok;
+
+	/*
+	 * Not llama_sampler_sample(): it would accept a token the grammar
+	 * may still reject into the chain (penalties).
+	 */
+	qllm_cand_fill(qctx, idx, &cur);
+	llama_sampler_apply(qctx->sampler, &cur);
+	tok = qllm_draw(&cur, greedy, u);
+
+	if (qctx->grammar && (tok < 0 || !qllm_grammar_allows(qctx, tok))) {
+		tok = -1;
+		if (cur.size < (size_t) qctx->words->n_vocab) {
+			llama_sampler_apply(qctx->grammar, &cur);
+			tok = qllm_draw(&cur, greedy, u);
+		}
+
+		if (tok < 0) {
+			qllm_cand_fill(qctx, idx, &cur);
+			llama_sampler_apply(qctx->grammar, &cur);
+			llama_sampler_apply(qctx->sampler, &cur);
+			tok = qllm_draw(&cur, greedy, u);
+		}
+	}
+
+	/* Nothing left to say: the grammar is at a dead end. */
+	if (tok < 0)
+		return llama_vocab_eos(qctx->vocab);
+
+	if (qctx->grammar)
+		llama_sampler_accept(qctx->grammar, tok);
+	llama_sampler_accept(qctx->sampler, tok);
+	return tok;
+}
+
+static llama_token
+qllm_sample(struct qllm_context *qctx, int32_t idx)
+{
+	uint64_t t0 = qllm_now_ns(), t1;
+	llama_token tok;
+
+	tok = qllm_sample_pick(qctx, idx);
+	t1 = qllm_now_ns();
+	qctx->stats.t_sample_ns += t1 - t0;
+	QLLM_TRACE("sample", t0, t1, tok);
+	return tok;
+}
+
+/* Start the sampler, and the grammar if any, over for a new reply. */
+static void
+qllm_sampler_reset(struct qllm_context *qctx)
+{
+	llama_sampler_reset(qctx->sampler);
+	if (qctx->grammar)
+		llama_sampler_reset(qctx->grammar);
+	qllm_rng_seed(qctx);
+}
+
+/* Per-sequence sampler and token buffers. */
+static int
+qllm_seq_init(struct qllm_context *qctx)
+{
+	qctx->sampler = qllm_sampler_new(&qctx->sampling);
+	if (!qctx->sampler)
+		return -1;
+	qllm_rng_seed(qctx);
+
+	qctx->cand = calloc((size_t) llama_vocab_n_tokens(qctx->vocab),
+	    sizeof(*qctx->cand));
+	qctx->token_buf = calloc((size_t)qctx->max_tokens,
+	    sizeof(*qctx->token_buf));
+	qctx->prompt_buf = calloc((size_t)qctx->max_tokens,
+	    sizeof(*qctx->prompt_buf));
+	/* One committed token at a time, unless speculation widens it. */
+	qctx->spec_buf = calloc(1, sizeof(*qctx->spec_buf));
+	if (!qctx->cand || !qctx->token_buf || !qctx->prompt_buf
+	    || !qctx->spec_buf)
+		return -1;
+
+	qctx->cur_pos = 0;
+	return 0;
+}
+
+/*
+ * Load the draft model into a context of its own with the same window
+ * as the main one. It must share the main model's vocabulary.
+ */
+static int
+qllm_spec_init_model(struct qllm_context *qctx,
+		     const struct qllm_config *cfg)
+{
+	struct llama_context_params params = qctx->params;
+	const struct llama_vocab *vocab;
+
+	params.n_ctx = (uint32_t) qctx->max_tokens;
+	params.n_seq_max = 1;
+	params.embeddings = false;
+	if (params.n_batch > params.n_ctx)
+		params.n_batch = params.n_ctx;
+	if (params.n_ubatch > params.n_batch)
+		params.n_ubatch = params.n_batch;
+
+	qctx->draft_entry = model_load(cfg->draft_model_path, params.n_ctx,
+	    cfg->max_offload_bytes, cfg->n_contexts);
+	if (!qctx->draft_entry)
+		return -1;
+
+	vocab = llama_model_get_vocab(qctx->draft_entry->model);
+	if (llama_vocab_n_tokens(vocab) != llama_vocab_n_tokens(qctx->vocab)
+	    || llama_vocab_bos(vocab) != llama_vocab_bos(qctx->vocab)
+	    || llama_vocab_eos(vocab) != llama_vocab_eos(qctx->vocab))
+		return -1;
+
+	qctx->draft_ctx = llama_init_from_model(qctx->draft_entry->model,
+	    params);
+	if (!qctx->draft_ctx)
+		return -1;
+
+	if (qctx->tp)
+		llama_attach_threadpool(qctx->draft_ctx, qctx->tp->pool,
+		    qctx->tp->pool_batch);
+
+	qctx->draft_smpl = llama_sampler_init_greedy();
+	if (!qctx->draft_smpl)
+		return -1;
+
+	qctx->draft_batch = llama_batch_init((int32_t)params.n_ubatch, 0, 1);
+	qctx->draft_hist = calloc((size_t)qctx->max_tokens,
+	    sizeof(*qctx->draft_hist));
+	if (!qctx->draft_hist)
+		return -1;
+
+	return 0;
+}
+
+/* Speculation sources: prompt lookup and/or a draft model. */
+static int
+qllm_spec_init(struct qllm_context *qctx,
+	       const struct qllm_config *cfg)
+{
+	uint32_t size = 1;
+
+	qctx->n_draft = cfg->n_draft > 0 ? cfg->n_draft : QLLM_SPEC_DRAFT;
+	if (qctx->n_draft >= (int32_t) qctx->params.n_batch)
+		qctx->n_draft = (int32_t) qctx->params.n_batch - 1;
+
+	free(qctx->spec_buf);
+	qctx->spec_buf = calloc((size_t)qctx->n_draft + 1,
+	    sizeof(*qctx->spec_buf));
+	if (!qctx->spec_buf)
+		return -1;
+
+	if (cfg->n_lookup > 0) {
+		/* Direct mapped, about two slots per position. */
+		while (size < 2 * (uint32_t)qctx->max_tokens)
+			size <<= 1;
+
+		qctx->n_lookup = cfg->n_lookup;
+		qctx->lookup_mask = size - 1;
+		qctx->lookup = calloc(size, sizeof(*qctx->lookup));
+		if (!qctx->lookup)
+			return -1;
+	}
+
+	if (cfg->draft_model_path)
+		return qllm_spec_init_model(qctx, cfg);
+
+	return 0;
+}
+
+struct qllm_context *
+qllm_create(const struct qllm_config *cfg)
+{
+	struct qllm_context *qctx;
+	struct llama_context_params ctx_params;
+	int32_t n_threads, n_seq_max;
+
+	if (!cfg || !cfg->model_path)
+		return NULL;
+
+	ctx_params = llama_context_default_params();
+
+	if (cfg->n_ctx > 0)
+		ctx_params.n_ctx = (uint32_t) cfg->n_ctx;
+	else
+		ctx_params.n_ctx = QLLM_N_CTX;
+
+	/* n_ctx is per sequence; the KV cache holds all of them. */
+	n_seq_max = cfg->n_seq_max > 1 ? cfg->n_seq_max : 1;
+	if (cfg->mode == QLLM_MODE_EMBED && cfg->n_seq_max <= 0)
+		n_seq_max = QLLM_EMBED_SEQS;
+	ctx_params.n_ctx *= (uint32_t) n_seq_max;
+
+	if (cfg->n_batch > 0 && (uint32_t) cfg->n_batch < ctx_params.n_ctx)
+		ctx_params.n_batch = (uint32_t) cfg->n_batch;
+	else
+		ctx_params.n_batch = ctx_params.n_ctx;
+
+	if (cfg->n_ubatch > 0)
+		ctx_params.n_ubatch = (uint32_t) cfg->n_ubatch;
+	if (ctx_params.n_ubatch > ctx_params.n_batch)
+		ctx_params.n_ubatch = ctx_params.n_batch;
+
+	ctx_params.n_seq_max = (uint32_t) n_seq_max;
+
+	switch (cfg->kv_type) {
+	case QLLM_KV_Q8_0:
+		ctx_params.type_k = ctx_params.type_v = GGML_TYPE_Q8_0;
+		break;
+	case QLLM_KV_Q4_0:
+		ctx_params.type_k = ctx_params.type_v = GGML_TYPE_Q4_0;
+		break;
+	default:
+		break;
+	}
+
+	switch (cfg->mode) {
+	case QLLM_MODE_GENERATE:
+		ctx_params.embeddings = false;
+		break;
+	case QLLM_MODE_EMBED:
+		/*
+		 * Pooled output only, with the model's own pooling. Whole
+		 * documents must fit one ubatch, so it spans the batch.
+		 */
+		ctx_params.embeddings = true;
+		ctx_params.pooling_type = LLAMA_POOLING_TYPE_UNSPECIFIED;
+		ctx_params.n_ubatch = ctx_params.n_batch;
+		break;
+	default:
+		/*
+		 * Embeddings are switched on only inside qllm_embed*(), and
+		 * need whole documents in one ubatch there too.
+		 */
+		ctx_params.embeddings = false;
+		ctx_params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+		ctx_params.n_ubatch = ctx_params.n_batch;
+		break;
+	}
+
+	if (cfg->n_threads > 0) {
+		n_threads = cfg->n_threads;
+	} else {
+		long ncpu;
+
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpu <= 0)
+			n_threads = 1;
+		else
+			n_threads = (int32_t)(ncpu > 1 ? ncpu / 2 : 1);
+	}
+
+	ctx_params.n_threads = n_threads;
+	ctx_params.n_threads_batch = n_threads;
+
+	/* Graphs are planned for the pool's threads. */
+	if (cfg->threadpool) {
+		ctx_params.n_threads = cfg->threadpool->n_threads;
+		ctx_params.n_threads_batch = cfg->threadpool->n_threads_batch;
+	}
+
+	qctx = calloc(1, sizeof(*qctx));
+	if (!qctx)
+		return NULL;
+
+	qctx->max_tokens = (int32_t)ctx_params.n_ctx / n_seq_max;
+	qctx->params = ctx_params;	/* <-- important: save params */
+	qctx->cache = cfg->cache;
+	qctx->n_seq_max = n_seq_max;
+	qctx->seq_id = 0;
+	qctx->mode = cfg->mode;
+	qctx->n_keep = cfg->no_shift ? -1 : cfg->n_keep;
+	qctx->sampling = cfg->sampling;
+
+	if (cfg->trace_path && qllm_trace_start(cfg->trace_path) != 0)
+		goto fail;
+
+	qctx->entry = model_load(cfg->model_path, ctx_params.n_ctx, cfg->max_offload_bytes, cfg->n_contexts);
+
+	if (!qctx->entry)
+		goto fail;
+
+	qctx->model = qctx->entry->model;
+
+	qctx->ctx = llama_init_from_model(qctx->model, ctx_params);
+	if (!qctx->ctx && ctx_params.type_v != GGML_TYPE_F16) {
+		/* A quantized V cache needs flash attention; keep K's. */
+		ctx_params.type_v = GGML_TYPE_F16;
+		qctx->params = ctx_params;
+		qctx->ctx = llama_init_from_model(qctx->model, ctx_params);
+	}
+	if (!qctx->ctx)
+		goto fail;
+
+	/* Generative models carry no pooling of their own. */
+	if (qctx->mode == QLLM_MODE_EMBED
+	    && llama_pooling_type(qctx->ctx) == LLAMA_POOLING_TYPE_NONE) {
+		llama_free(qctx->ctx);
+		ctx_params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+		qctx->params = ctx_params;
+		qctx->ctx = llama_init_from_model(qctx->model, ctx_params);
+		if (!qctx->ctx)
+			goto fail;
+	}
+
+	if (cfg->threadpool) {
+		qctx->tp = qllm_threadpool_retain(cfg->threadpool);
+		llama_attach_threadpool(qctx->ctx, qctx->tp->pool,
+		    qctx->tp->pool_batch);
+	}
+
+	qctx->vocab = llama_model_get_vocab(qctx->model);
+	qctx->words = qctx->entry;
+	qctx->n_embd = llama_model_n_embd(qctx->model);
+
+	if (qllm_seq_init(qctx) != 0)
+		goto fail;
+
+	if (n_seq_max > 1) {
+		/* Sequence 0 belongs to the owner itself. */
+		qctx->seq_used = calloc((size_t)n_seq_max,
+		    sizeof(*qctx->seq_used));
+		if (!qctx->seq_used)
+			goto fail;
+		qctx->seq_used[0] = 1;
+
+		qctx->step_idx = calloc((size_t)n_seq_max,
+		    sizeof(*qctx->step_idx));
+		qctx->step_add = calloc((size_t)n_seq_max,
+		    sizeof(*qctx->step_add));
+		if (!qctx->step_idx || !qctx->step_add)
+			goto fail;
+	}
+
+	qctx->batch = llama_batch_init((int32_t)ctx_params.n_batch, 0, 1);
+
+	if (cfg->draft_model_path || cfg->n_lookup > 0) {
+		if (n_seq_max > 1 || qctx->mode == QLLM_MODE_EMBED
+		    || qllm_spec_init(qctx, cfg) != 0)
+			goto fail;
+	}
+
+	return qctx;
+
+fail:
+	qllm_free(qctx);
+	return NULL;
+}
+
+struct qllm_context *
+qllm_seq_create(struct qllm_context *owner)
+{
+	struct qllm_context *seq;
+	llama_seq_id id;
+
+	if (!owner || owner->owner || !owner->seq_used)
+		return NULL;
+
+	for (id = 1; id < owner->n_seq_max; id++)
+		if (!owner->seq_used[id])
+			break;
+
+	if (id >= owner->n_seq_max)
+		return NULL;
+
+	seq = calloc(1, sizeof(*seq));
+	if (!seq)
+		return NULL;
+
+	seq->owner = owner;
+	seq->model = owner->model;
+	seq->ctx = owner->ctx;
+	seq->cache = owner->cache;
+	seq->params = owner->params;
+	seq->vocab = owner->vocab;
+	seq->words = owner->words;
+	seq->tp = owner->tp;
+	seq->mode = owner->mode;
+	seq->n_embd = owner->n_embd;
+	seq->max_tokens = owner->max_tokens;
+	seq->n_keep = owner->n_keep;
+	seq->sampling = owner->sampling;
+	seq->n_seq_max = 1;
+	seq->seq_id = id;
+
+	if (qllm_seq_init(seq) != 0) {
+		seq->ctx = NULL;
+		qllm_free(seq);
+		return NULL;
+	}
+
+	llama_memory_seq_rm(llama_get_memory(seq->ctx), id, -1, -1);
+	owner->seq_used[id] = 1;
+	return seq;
+}
+
+void
+qllm_free(struct qllm_context *qctx)
+{
+	if (!qctx)
+		return;
+
+	if (qctx->sampler)
+		llama_sampler_free(qctx->sampler);
+	if (qctx->grammar)
+		llama_sampler_free(qctx->grammar);
+	free(qctx->cand);
+	qllm_stop_free(qctx->stop);
+	free(qctx->text);
+
+	if (qctx->owner) {
+		/* A sequence: give back its KV cells and id. */
+		if (qctx->ctx) {
+			llama_memory_seq_rm(llama_get_memory(qctx->ctx),
+			    qctx->seq_id, -1, -1);
+			qctx->owner->seq_used[qctx->seq_id] = 0;
+		}
+	} else {
+		if (qctx->batch.token)
+			llama_batch_free(qctx->batch);
+		if (qctx->ctx)
+			llama_free(qctx->ctx);
+		qllm_model_release(qctx->entry);
+
+		if (qctx->draft_smpl)
+			llama_sampler_free(qctx->draft_smpl);
+		if (qctx->draft_batch.token)
+			llama_batch_free(qctx->draft_batch);
+		if (qctx->draft_ctx)
+			llama_free(qctx->draft_ctx);
+		if (qctx->draft_entry)
+			qllm_model_release(qctx->draft_entry);
+		free(qctx->draft_hist);
+		free(qctx->lookup);
+		qllm_threadpool_free(qctx->tp);
+	}
+
+	free(qctx->token_buf);
+	free(qctx->prompt_buf);
+	free(qctx->spec_buf);
+	free(qctx->seq_used);
+	free(qctx->step_idx);
+	free(qctx->step_add);
+
+	free(qctx);
+}
+
+/* Queue generated text for the caller. */
+static void
+qllm_text_add(struct qllm_context *qctx, const char *s, size_t n)
+{
+	size_t cap;
+	char *p;
+
+	if (!n)
+		return;
+
+	if (qctx->text_len + n > qctx->text_cap) {
+		cap = qctx->text_cap ? qctx->text_cap : QLLM_PIECE_MAX;
+		while (cap < qctx->text_len + n)
+			cap *= 2;
+		p = realloc(qctx->text, cap);
+		if (!p)
+			return;
+		qctx->text = p;
+		qctx->text_cap = cap;
+	}
+
+	memcpy(qctx->text + qctx->text_len, s, n);
+	qctx->text_len += n;
+}
+
+/*
+ * End of the queued text that is whole UTF-8: a code point split
+ * across tokens waits for the rest, unless generation is over (all).
+ */
+static size_t
+qllm_text_ready(const struct qllm_context *qctx, int all)
+{
+	const unsigned char *t = (const unsigned char *) qctx->text;
+	size_t end = qctx->text_len, p = end, need;
+
+	if (all)
+		return end;
+
+	while (p > qctx->text_off && end - p < 4 && (t[p - 1] & 0xc0) == 0x80)
+		p--;
+	if (p == qctx->text_off || end - p >= 4)
+		return end;
+
+	p--;	/* the lead byte, if any */
+	if ((t[p] & 0xe0) == 0xc0)
+		need = 2;
+	else if ((t[p] & 0xf0) == 0xe0)
+		need = 3;
+	else if ((t[p] & 0xf8) == 0xf0)
+		need = 4;
+	else
+		return end;
+
+	return end - p < need ? p : end;
+}
+
+/* Drop handed out text, keeping any split code point. */
+static void
+qllm_text_compact(struct qllm_context *qctx)
+{
+	size_t n = qctx->text_len - qctx->text_off;
+
+	if (n && qctx->text_off)
+		memmove(qctx->text, qctx->text + qctx->text_off, n);
+	qctx->text_len = n;
+	qctx->text_off = 0;
+}
+
+/* Hand queued text to cb: all of it at the end of generation. */
+static void
+qllm_text_flush(struct qllm_context *qctx, qllm_token_cb cb, void *user,
+		int all)
+{
+	size_t end = qllm_text_ready(qctx, all);
+	uint64_t t0;
+
+	if (end > qctx->text_off) {
+		t0 = QLLM_TRACE_T0();
+		cb(user, qctx->text + qctx->text_off, end - qctx->text_off);
+		QLLM_TRACE("callback", t0, qllm_now_ns(),
+		    (int64_t) (end - qctx->text_off));
+		qctx->gen_out += end - qctx->text_off;
+	}
+	qctx->text_off = end;
+	qllm_text_compact(qctx);
+}
+
+/* Generation ended some other way: the held text was no stop. */
+static void
+qllm_stop_release(struct qllm_context *qctx)
+{
+	struct qllm_stop *st = qctx->stop;
+
+	if (!st)
+		return;
+
+	qllm_text_add(qctx, st->hold, st->n_hold);
+	st->n_hold = 0;
+	st->state = 0;
+}
+
+/*
+ * Run a sampled token through the stop checks before it is decoded.
+ * Its text is queued, except for a tail that may still turn out to be
+ * the start of a stop sequence, which is held back until it is known.
+ * Returns 1 if the token ends generation instead (end of generation
+ * token or a stop), with only the text before the stop queued.
+ */
+static int
+qllm_stop_scan(struct qllm_context *qctx, llama_token tok)
+{
+	struct qllm_stop *st = qctx->stop;
+	const char *piece;
+	size_t i, n, total, keep;
+	int32_t state;
+
+	if (llama_vocab_is_eog(qctx->vocab, tok)) {
+		qllm_stop_release(qctx);
+		return 1;
+	}
+
+	if (st)
+		for (i = 0; i < st->n_tokens; i++)
+			if (st->tokens[i] == tok) {
+				qllm_stop_release(qctx);
+				return 1;
+			}
+
+	piece = qllm_piece(qctx, tok, &n);
+	if (!n)
+		return 0;
+
+	if (!st) {
+		qllm_text_add(qctx, piece, n);
+		return 0;
+	}
+
+	memcpy(st->hold + st->n_hold, piece, n);
+	total = st->n_hold + n;
+	state = st->state;
+
+	for (i = st->n_hold; i < total; i++) {
+		state = st->next[state][(unsigned char) st->hold[i]];
+		if (st->match[state]) {
+			qllm_text_add(qctx, st->hold,
+			    i + 1 - (size_t) st->match[state]);
+			st->n_hold = 0;
+			st->state = 0;
+			return 1;
+		}
+	}
+
+	keep = (size_t) st->depth[state];
+	qllm_text_add(qctx, st->hold, total - keep);
+	memmove(st->hold, st->hold + total - keep, keep);
+	st->n_hold = keep;
+	st->state = state;
+	return 0;
+}
+
+/* Detokenizing and stop matching, timed. */
+static int
+qllm_stop_feed(struct qllm_context *qctx, llama_token tok)
+{
+	uint64_t t0, t1;
+	int ret;
+
+	/* The first token sampled goes right after the prompt. */
+	if (!qctx->gen_live) {
+		qctx->gen_live = 1;
+		qctx->gen_pos = qctx->cur_pos;
+		qctx->gen_out = 0;
+		qctx->gen_seen = 0;
+	}
+
+	t0 = qllm_now_ns();
+	ret = qllm_stop_scan(qctx, tok);
+	t1 = qllm_now_ns();
+	qctx->stats.t_detok_ns += t1 - t0;
+	QLLM_TRACE("detokenize", t0, t1, tok);
+	return ret;
+}
+
+/*
+ * Take the tokens of the reply the caller never got out of the history
+ * and the KV cache: speculation commits ahead of what is handed out,
+ * and a stop drops the text it matched, with whatever held it back.
+ * A token stays if any of its text went out; qllm_gen_keep() says up
+ * to where, without changing anything.
+ */
+static llama_pos
+qllm_gen_keep(const struct qllm_context *qctx)
+{
+	llama_pos p = qctx->gen_pos;
+	size_t n, seen = 0;
+
+	if (!qctx->gen_live)
+		return qctx->cur_pos;
+
+	if (qctx->gen_seen)
+		return qctx->gen_seen;
+
+	for (; p < qctx->cur_pos && seen < qctx->gen_out; p++) {
+		qllm_piece(qctx, qctx->token_buf[p], &n);
+		seen += n;
+	}
+
+	return p;
+}
+
+static void
+qllm_gen_rollback(struct qllm_context *qctx)
+{
+	if (!qctx->gen_live)
+		return;
+
+	qllm_truncate(qctx, qllm_gen_keep(qctx));
+	qctx->gen_live = 0;
+}
+
+/* A new reply starts: forget undelivered text and the pending token. */
+static void
+qllm_gen_reset(struct qllm_context *qctx)
+{
+	qllm_gen_rollback(qctx);
+	qctx->has_next = 0;
+	qctx->text_len = qctx->text_off = 0;
+	qctx->n_commit = qctx->commit_off = 0;
+	qctx->ended = 0;
+
+	if (qctx->stop) {
+		qctx->stop->n_hold = 0;
+		qctx->stop->state = 0;
+	}
+}
+
+/* Append prompt tokens to whatever the sequence still has queued. */
+static int
+qllm_seq_queue(struct qllm_context *seq,
+	       const char *prompt,
+	       int gen)
+{
+	int32_t n_prompt, n_keep, cap;
+
+	if (!seq || !seq->ctx || !prompt
+	    || (gen && seq->mode == QLLM_MODE_EMBED))
+		return -1;
+
+	if (seq->n_pending > 0 && seq->pending_off > 0)
+		memmove(seq->prompt_buf, seq->prompt_buf + seq->pending_off,
+		    (size_t)seq->n_pending * sizeof(*seq->prompt_buf));
+	if (seq->n_pending < 0)
+		seq->n_pending = 0;
+	seq->pending_off = 0;
+
+	/* Whatever does not fit after the history is made room for later. */
+	cap = seq->max_tokens - seq->n_pending;
+	n_prompt = qllm_tokenize_run(seq, prompt,
+	    seq->prompt_buf + seq->n_pending, cap, 1);
+	if (n_prompt < 0)
+		return -1;
+
+	/* A token sampled but never decoded is dropped. */
+	qllm_gen_reset(seq);
+	seq->gen = gen;
+
+	if (seq->n_pending == 0) {
+		seq->fresh = seq->cur_pos == 0;
+
+		if (seq->fresh && n_prompt > 0) {
+			n_keep = qllm_cache_restore(seq, seq->prompt_buf,
+			    n_prompt, 0);
+			seq->stats.n_reused += (uint64_t) n_keep;
+			seq->pending_off = n_keep;
+			n_prompt -= n_keep;
+		}
+	}
+
+	seq->n_pending += n_prompt;
+	qllm_sampler_reset(seq);
+	return 0;
+}
+
+int
+qllm_seq_prompt(struct qllm_context *seq,
+		const char *prompt)
+{
+	return qllm_seq_queue(seq, prompt, 1);
+}
+
+int
+qllm_seq_prefill(struct qllm_context *seq,
+		 const char *prompt)
+{
+	return qllm_seq_queue(seq, prompt, 0);
+}
+
+int
+qllm_seq_busy(const struct qllm_context *seq)
+{
+	return seq && (seq->n_pending > 0 || seq->has_next);
+}
+
+int
+qllm_step(struct qllm_context **seqs,
+	  size_t n,
+	  int32_t n_max,
+	  qllm_token_cb cb,
+	  void **user)
+{
+	struct qllm_context *owner, *seq;
+	struct llama_batch *batch;
+	int32_t *out_idx, *n_add;
+	int32_t budget, chunk, j;
+	uint64_t t0, dt;
+	int busy = 0, ret;
+	llama_token tok;
+	size_t i;
+
+	if (!seqs || !n || !cb)
+		return -1;
+
+	owner = seqs[0]->owner ? seqs[0]->owner : seqs[0];
+	if (!owner->seq_used || n > (size_t)owner->n_seq_max)
+		return -1;
+
+	batch = &owner->batch;
+	budget = (int32_t)owner->params.n_batch;
+	if (n_max > 0 && n_max < budget)
+		budget = n_max;
+
+	out_idx = owner->step_idx;
+	n_add = owner->step_add;
+	memset(n_add, 0, n * sizeof(*n_add));
+	batch->n_tokens = 0;
+
+	for (i = 0; i < n; i++)
+		out_idx[i] = -1;
+
+	/* Generating sequences first: one token each keeps them moving. */
+	for (i = 0; i < n && budget > 0; i++) {
+		seq = seqs[i];
+
+		if (!seq->has_next)
+			continue;
+
+		if (qllm_shift(seq, 1) != 0) {
+			seq->has_next = 0;
+			qllm_stop_release(seq);
+			qllm_text_flush(seq, cb, user ? user[i] : NULL, 1);
+			continue;
+		}
+
+		qllm_batch_add(batch, seq, seq->next_tok, seq->cur_pos, 1);
+		out_idx[i] = batch->n_tokens - 1;
+		n_add[i] = 1;
+		budget--;
+	}
+
+	/* Then prefill chunks of queued prompts with what is left. */
+	for (i = 0; i < n && budget > 0; i++) {
+		seq = seqs[i];
+
+		if (seq->n_pending <= 0 || n_add[i])
+			continue;
+
+		chunk = seq->n_pending < budget ? seq->n_pending : budget;
+
+		if (qllm_shift(seq, chunk) != 0) {
+			/* Too long to ever fit: drop it. */
+			seq->n_pending = 0;
+			seq->gen = 0;
+			continue;
+		}
+
+		for (j = 0; j < chunk; j++)
+			qllm_batch_add(batch, seq,
+			    seq->prompt_buf[seq->pending_off + j],
+			    seq->cur_pos + j,
+			    seq->gen && chunk == seq->n_pending
+			    && j == chunk - 1);
+
+		if (seq->gen && chunk == seq->n_pending)
+			out_idx[i] = batch->n_tokens - 1;
+		n_add[i] = chunk;
+		budget -= chunk;
+	}
+
+	if (owner->tp)
+		pthread_mutex_lock(&owner->tp->lock);
+	t0 = qllm_now_ns();
+	ret = batch->n_tokens ? llama_decode(owner->ctx, *batch) : 0;
+	dt = qllm_now_ns() - t0;
+	if (owner->tp)
+		pthread_mutex_unlock(&owner->tp->lock);
+	if (ret != 0)
+		return -1;
+	if (batch->n_tokens)
+		QLLM_TRACE("decode", t0, t0 + dt, batch->n_tokens);
+
+	for (i = 0; i < n; i++) {
+		seq = seqs[i];
+
+		/* The shared decode is charged by tokens. */
+		if (n_add[i])
+			seq->stats.t_decode_ns += dt * (uint64_t) n_add[i]
+			    / (uint64_t) batch->n_tokens;
+
+		if (seq->has_next && n_add[i]) {
+			seq->token_buf[seq->cur_pos++] = seq->next_tok;
+			seq->has_next = 0;
+			seq->stats.n_generated++;
+		} else if (n_add[i]) {
+			seq->stats.n_prefilled += (uint64_t) n_add[i];
+			memcpy(seq->token_buf + seq->cur_pos,
+			    seq->prompt_buf + seq->pending_off,
+			    (size_t)n_add[i] * sizeof(*seq->token_buf));
+			seq->cur_pos += n_add[i];
+			seq->pending_off += n_add[i];
+			seq->n_pending -= n_add[i];
+
+			if (!seq->n_pending && seq->fresh)
+				qllm_cache_store(seq);
+		}
+
+		if (out_idx[i] < 0) {
+			busy += qllm_seq_busy(seq);
+			continue;
+		}
+
+		tok = qllm_sample(seq, out_idx[i]);
+
+		/* Decoded next step, after making room if the sequence is full. */
+		if (!qllm_stop_feed(seq, tok)) {
+			seq->next_tok = tok;
+			seq->has_next = 1;
+			busy++;
+		}
+
+		qllm_text_flush(seq, cb, user ? user[i] : NULL,
+		    !seq->has_next);
+	}
+
+	return busy;
+}
+
+/* FNV-1a over n tokens. */
+static uint32_t
+qllm_ngram_hash(const llama_token *toks, int32_t n)
+{
+	uint32_t h = 2166136261u;
+	int32_t i;
+
+	for (i = 0; i < n; i++) {
+		h ^= (uint32_t) toks[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/*
+ * Prompt lookup: find the n-gram ending with tok earlier in token_buf
+ * and propose up to n_max tokens that followed it there. The index
+ * remembers the latest end position of every n-gram seen so far.
+ */
+static int32_t
+qllm_spec_lookup(struct qllm_context *qctx,
+		 llama_token tok,
+		 llama_token *draft,
+		 int32_t n_max)
+{
+	const llama_token *buf = qctx->token_buf;
+	int32_t n = qctx->n_lookup;
+	llama_token *key = draft;	/* scratch until the copy below */
+	llama_pos p;
+	int32_t i;
+
+	if (qctx->cur_pos < n || n_max < n)
+		return 0;
+
+	if (qctx->lookup_pos < n - 1)
+		qctx->lookup_pos = n - 1;
+	for (p = qctx->lookup_pos; p < qctx->cur_pos; p++)
+		qctx->lookup[qllm_ngram_hash(buf + p - n + 1, n)
+		    & qctx->lookup_mask] = p + 1;
+	qctx->lookup_pos = qctx->cur_pos;
+
+	memcpy(key, buf + qctx->cur_pos - n + 1,
+	    (size_t)(n - 1) * sizeof(*key));
+	key[n - 1] = tok;
+
+	p = qctx->lookup[qllm_ngram_hash(key, n) & qctx->lookup_mask] - 1;
+	if (p < n - 1 || p + 1 >= qctx->cur_pos
+	    || memcmp(buf + p - n + 1, key, (size_t)n * sizeof(*key)))
+		return 0;
+
+	for (i = 0; i < n_max && p + 1 + i < qctx->cur_pos; i++)
+		draft[i] = buf[p + 1 + i];
+
+	qctx->spec.n_lookup++;
+	return i;
+}
+
+/*
+ * Let the draft model propose up to n_max tokens following token_buf
+ * and tok. The draft KV keeps whatever prefix it shares with them.
+ */
+static int32_t
+qllm_spec_draft(struct qllm_context *qctx,
+		llama_token tok,
+		llama_token *draft,
+		int32_t n_max)
+{
+	llama_pos n = 0, n_total = qctx->cur_pos + 1;
+	int32_t i;
+
+	while (n < qctx->draft_pos && n < qctx->cur_pos
+	       && qctx->draft_hist[n] == qctx->token_buf[n])
+		n++;
+
+	if (n == qctx->cur_pos && n < qctx->draft_pos
+	    && qctx->draft_hist[n] == tok)
+		n++;
+
+	/* The last one is decoded again for its logits. */
+	if (n == n_total)
+		n--;
+
+	llama_memory_seq_rm(llama_get_memory(qctx->draft_ctx), 0, n, -1);
+	memcpy(qctx->draft_hist + n, qctx->token_buf + n,
+	    (size_t)(qctx->cur_pos - n) * sizeof(*qctx->draft_hist));
+	qctx->draft_hist[qctx->cur_pos] = tok;
+
+	qctx->draft_pos = n + qllm_decode_run(qctx->draft_ctx,
+	    &qctx->draft_batch, qctx, qctx->draft_hist + n, n_total - n, n);
+	if (qctx->draft_pos != n_total)
+		return 0;
+
+	for (i = 0; i < n_max; i++) {
+		draft[i] = llama_sampler_sample(qctx->draft_smpl,
+		    qctx->draft_ctx, -1);
+
+		if (llama_vocab_is_eog(qctx->vocab, draft[i]))
+			break;
+
+		if (i == n_max - 1)
+			return n_max;
+
+		if (qllm_decode_run(qctx->draft_ctx, &qctx->draft_batch, qctx,
+		    draft + i, 1, qctx->draft_pos) != 1)
+			break;
+
+		qctx->draft_hist[qctx->draft_pos++] = draft[i];
+	}
+
+	return i;
+}
+
+/*
+ * Decode toks[0] and the n_spec tokens proposed after it in one batch,
+ * keep the longest run the main model agrees with, and hold the token
+ * it samples after that for the next step.
+ * Returns how many tokens were committed.
+ */
+static int32_t
+qllm_spec_verify(struct qllm_context *qctx,
+		 const llama_token *toks,
+		 int32_t n_spec)
+{
+	struct llama_batch *batch = &qctx->batch;
+	llama_token tok = 0;
+	int32_t i;
+
+	batch->n_tokens = 0;
+	for (i = 0; i <= n_spec; i++)
+		qllm_batch_add(batch, qctx, toks[i], qctx->cur_pos + i, 1);
+
+	if (qllm_llama_decode(qctx, qctx->ctx, batch) != 0)
+		return -1;
+
+	for (i = 0; i <= n_spec; i++) {
+		tok = qllm_sample(qctx, i);
+
+		if (i == n_spec || tok != toks[i + 1])
+			break;
+	}
+
+	llama_memory_seq_rm(llama_get_memory(qctx->ctx), qctx->seq_id,
+	    qctx->cur_pos + i + 1, -1);
+	memcpy(qctx->token_buf + qctx->cur_pos, toks,
+	    (size_t)(i + 1) * sizeof(*toks));
+	qctx->cur_pos += i + 1;
+
+	qctx->next_tok = tok;
+	qctx->has_next = 1;
+
+	qctx->spec.n_steps++;
+	qctx->spec.n_drafted += (uint64_t) n_spec;
+	qctx->spec.n_accepted += (uint64_t) i;
+	return i + 1;
+}
+
+/*
+ * Commit the next token(s) of a generation to the KV cache and to out
+ * (room for n_draft + 1), queueing their text. Sets ended when
+ * generation is over.
+ * Returns how many, or -1 on error.
+ */
+static int32_t
+qllm_gen_step(struct qllm_context *qctx,
+	      llama_token *out)
+{
+	int32_t n_max, n_spec = 0, looked = 0, n, i;
+	llama_token tok;
+
+	if (qctx->has_next) {
+		tok = qctx->next_tok;
+		qctx->has_next = 0;
+	} else {
+		tok = qllm_sample(qctx, -1);
+	}
+
+	/* A stop costs no decode. */
+	if (qllm_stop_feed(qctx, tok)) {
+		qctx->ended = 1;
+		return 0;
+	}
+
+	out[0] = tok;
+
+	if (qctx->n_draft) {
+		n_max = qctx->n_draft;
+		if (qllm_shift(qctx, n_max + 1) != 0
+		    && qllm_shift(qctx, 1) != 0)
+			return -1;
+		if (n_max > qctx->max_tokens - qctx->cur_pos - 1)
+			n_max = qctx->max_tokens - qctx->cur_pos - 1;
+
+		/* Copying from the context is free; the draft model is not. */
+		if (n_max > 0 && qctx->n_lookup) {
+			n_spec = qllm_spec_lookup(qctx, tok, out + 1, n_max);
+			looked = n_spec > 0;
+		}
+		if (n_max > 0 && !n_spec && qctx->draft_ctx)
+			n_spec = qllm_spec_draft(qctx, tok, out + 1, n_max);
+	}
+
+	if (n_spec > 0) {
+		n = qllm_spec_verify(qctx, out, n_spec);
+		if (n < 0)
+			return -1;
+		if (looked && n > 0)
+			qctx->spec.n_lookup_accepted += (uint64_t)(n - 1);
+
+		/* Accepted drafts may run into a stop: cut them there. */
+		for (i = 1; i < n; i++) {
+			if (!qllm_stop_feed(qctx, out[i]))
+				continue;
+
+			qllm_truncate(qctx, qctx->cur_pos - (n - i));
+			qctx->has_next = 0;
+			qctx->ended = 1;
+			qctx->stats.n_generated += (uint64_t) i;
+			return i;
+		}
+
+		qctx->stats.n_generated += (uint64_t) n;
+		return n;
+	}
+
+	if (qllm_decode_tokens(qctx, &tok, 1) != 0)
+		return -1;
+
+	qctx->stats.n_generated++;
+	return 1;
+}
+
+/* Internal streaming helper: runs generation and calls cb() for each piece. */
+static int
+qllm_generate_stream_internal(struct qllm_context *qctx,
+			      const char *prompt,
+			      qllm_token_cb cb,
+			      void *user)
+{
+	int32_t n_prompt, n;
+	int32_t step;
+	const int32_t max_gen = qctx->max_tokens;
+
+	if (!qctx || !qctx->ctx || !prompt || !cb
+	    || qctx->mode == QLLM_MODE_EMBED)
+		return -1;
+
+	qllm_gen_reset(qctx);
+
+	n_prompt = qllm_tokenize_prompt(qctx, prompt);
+	if (n_prompt < 0)
+		return -1;
+
+	if (n_prompt == 0)
+		return 0;
+
+	if (qllm_sync_tokens(qctx, qctx->prompt_buf, n_prompt) != 0)
+		return -1;
+
+	qllm_sampler_reset(qctx);
+
+	for (step = 0; step < max_gen && !qctx->ended; step += n) {
+		n = qllm_gen_step(qctx, qctx->spec_buf);
+		qllm_text_flush(qctx, cb, user, qctx->ended);
+		if (n < 0)
+			return -1;
+	}
+
+	if (!qctx->ended) {
+		/* Out of tokens, not stopped. */
+		qllm_stop_release(qctx);
+		qllm_text_flush(qctx, cb, user, 1);
+	}
+
+	qllm_gen_rollback(qctx);
+	return 0;
+}
+
+int
+qllm_generate_stream(struct qllm_context *qctx,
+		     const char *prompt,
+		     qllm_token_cb cb,
+		     void *user)
+{
+	if (!qctx || !prompt || !cb)
+		return -1;
+
+	return qllm_generate_stream_internal(qctx, prompt, cb, user);
+}
+
+/* Accumulator used by qllm_generate() to build a string. */
+struct qllm_accum {
+	char	*buf;
+	size_t	 cap;
+	size_t	 len;
+};
+
+static void
+qllm_accum_cb(void *user, const char *chunk, size_t len)
+{
+	struct qllm_accum *acc = user;
+	size_t n;
+
+	if (!acc || !acc->buf || acc->cap == 0)
+		return;
+
+	if (acc->len >= acc->cap)
+		return;
+
+	n = len;
+	if (acc->len + n >= acc->cap) {
+		if (acc->cap <= acc->len + 1)
+			return;
+		n = acc->cap - acc->len - 1;
+	}
+
+	if (!n)
+		return;
+
+	memcpy(acc->buf + acc->len, chunk, n);
+	acc->len += n;
+	acc->buf[acc->len] = '\0';
+}
+
+long
+qllm_generate(struct qllm_context *qctx,
+	      const char *prompt,
+	      char *out,
+	      size_t out_size)
+{
+	struct qllm_accum acc;
+	int ret;
+
+	if (!qctx || !prompt || !out || out_size == 0)
+		return -1;
+
+	out[0] = '\0';
+
+	acc.buf = out;
+	acc.cap = out_size;
+	acc.len = 0;
+
+	ret = qllm_generate_stream_internal(qctx,
+					    prompt,
+					    qllm_accum_cb,
+					    &acc);
+	if (ret != 0)
+		return -1;
+
+	return (ssize_t) acc.len;
+}
+
+/*
+ * qllm_embed — return a single embedding vector for the whole text.
+ * Returns number of dims on success, < 0 on error.
+ */
+int
+qllm_embed(struct qllm_context *qctx,
+	   const char *text,
+	   float *out,
+	   size_t out_dim)
+{
+	if (!text)
+		return -1;
+
+	return qllm_embed_batch(qctx, &text, 1, out, out_dim);
+}
+
+/*
+ * Sequence ids an embedding batch may use: our own, plus every id of
+ * the owner nobody has taken. Returns how many were stored in ids.
+ */
+static int32_t
+qllm_embed_seqs(struct qllm_context *qctx, llama_seq_id *ids)
+{
+	int32_t n = 0;
+	llama_seq_id id;
+
+	ids[n++] = qctx->seq_id;
+
+	if (qctx->owner || !qctx->seq_used)
+		return n;
+
+	for (id = 0; id < qctx->n_seq_max; id++)
+		if (!qctx->seq_used[id])
+			ids[n++] = id;
+
+	return n;
+}
+
+/*
+ * Pooling is per sequence, so documents are packed as separate
+ * sequences into each batch, as many as fit in n_batch tokens.
+ */
+int
+qllm_embed_batch(struct qllm_context *qctx,
+		 const char **texts,
+		 size_t n,
+		 float *out,
+		 size_t stride)
+{
+	struct qllm_context *owner;
+	struct llama_batch *batch;
+	llama_memory_t mem;
+	llama_seq_id *ids;
+	int32_t *last;
+	int32_t n_ids = 0, n_tok, room, k, j, t;
+	const float *embd;
+	size_t done = 0;
+	int ret = -1;
+
+	if (!qctx || !qctx->ctx || !texts || !out)
+		return -1;
+
+	if (stride < (size_t) qctx->n_embd || qctx->mode == QLLM_MODE_GENERATE)
+		return -1;
+
+	owner = qctx->owner ? qctx->owner : qctx;
+	batch = &owner->batch;
+	mem = llama_get_memory(qctx->ctx);
+
+	ids = calloc((size_t)owner->n_seq_max, sizeof(*ids));
+	last = calloc((size_t)owner->n_seq_max, sizeof(*last));
+	if (!ids || !last)
+		goto out;
+
+	n_ids = qllm_embed_seqs(qctx, ids);
+
+	/* Our own token history goes away with the first batch. */
+	qllm_gen_reset(qctx);
+	qllm_lookup_trim(qctx, 0);
+	qctx->cur_pos = 0;
+
+	if (qctx->mode == QLLM_MODE_BOTH)
+		llama_set_embeddings(qctx->ctx, true);
+
+	while (done < n) {
+		batch->n_tokens = 0;
+
+		for (k = 0; k < n_ids && done + (size_t)k < n; k++) {
+			const char *text = texts[done + (size_t)k];
+
+			if (!text)
+				goto out;
+
+			room = (int32_t)owner->params.n_batch - batch->n_tokens;
+			if (room > qctx->max_tokens)
+				room = qctx->max_tokens;
+
+			n_tok = qllm_tokenize_run(qctx, text,
+			    batch->token + batch->n_tokens, room, 1);
+
+			/* Does not fit: leave it for the next batch. */
+			if (n_tok < 0 && k > 0)
+				break;
+
+			if (n_tok <= 0)
+				goto out;
+
+			for (t = 0; t < n_tok; t++) {
+				j = batch->n_tokens + t;
+				batch->pos[j] = t;
+				batch->n_seq_id[j] = 1;
+				batch->seq_id[j][0] = ids[k];
+				batch->logits[j] = 1;
+			}
+
+			batch->n_tokens += n_tok;
+			last[k] = batch->n_tokens - 1;
+			llama_memory_seq_rm(mem, ids[k], -1, -1);
+		}
+
+		if (qllm_llama_decode(qctx, qctx->ctx, batch) != 0)
+			goto out;
+		qctx->stats.n_prefilled += (uint64_t) batch->n_tokens;
+
+		for (j = 0; j < k; j++) {
+			embd = llama_get_embeddings_seq(qctx->ctx, ids[j]);
+			if (!embd)	/* no pooling: use the last token */
+				embd = llama_get_embeddings_ith(qctx->ctx,
+				    last[j]);
+			if (!embd)
+				goto out;
+
+			memcpy(out + (done + (size_t)j) * stride, embd,
+			    (size_t)qctx->n_embd * sizeof(*out));
+			llama_memory_seq_rm(mem, ids[j], -1, -1);
+		}
+
+		done += (size_t)k;
+	}
+
+	ret = qctx->n_embd;
+
+out:
+	if (qctx->mode == QLLM_MODE_BOTH)
+		llama_set_embeddings(qctx->ctx, false);
+	if (ret < 0 && ids)
+		for (j = 0; j < n_ids; j++)
+			llama_memory_seq_rm(mem, ids[j], -1, -1);
+	free(ids);
+	free(last);
+	return ret;
+}
+
+int
+qllm_prime_tokens(struct qllm_context *qctx,
+		  const qllm_token *tokens,
+		  int32_t n_tokens)
+{
+	if (!qctx || !qctx->ctx || (!tokens && n_tokens > 0) || n_tokens < 0
+	    || n_tokens > qctx->max_tokens)
+		return -1;
+
+	qllm_gen_reset(qctx);
+
+	if (n_tokens == 0)
+		return 0;
+
+	/* What follows is a new reply as far as the grammar goes. */
+	if (qctx->grammar)
+		llama_sampler_reset(qctx->grammar);
+
+	/* A fresh context may start from a cached prefix. */
+	if (qctx->cur_pos == 0)
+		return qllm_sync_tokens(qctx, tokens, n_tokens);
+
+	if (qllm_decode_tokens(qctx, tokens, n_tokens) != 0)
+		return -1;
+
+	qctx->stats.n_prefilled += (uint64_t) n_tokens;
+	return 0;
+}
+
+int
+qllm_prime(struct qllm_context *qctx,
+	   const char *prompt)
+{
+	int32_t n_prompt;
+
+	if (!qctx || !qctx->ctx || !prompt)
+		return -1;
+
+	n_prompt = qllm_tokenize_prompt(qctx, prompt);
+	if (n_prompt < 0)
+		return -1;
 
-	n_layers = llama_model_n_layer(model);
-	n_embd = llama_model_n_embd(model);
-	llama_model_free(model);
-	ngl = auto_ngl(path, 0, n_ctx, ngl_max, n_layers, n_embd, n_contexts);
+	return qllm_prime_tokens(qctx, qctx->prompt_buf, n_prompt);
+}
 
-	if (ngl > 0)
-		model_params.n_gpu_layers = ngl;
-	else
-		model_params.n_gpu_layers = 0;
+int32_t
+qllm_tokenize(struct qllm_context *qctx,
+	      const char *text,
+	      qllm_token *out,
+	      int32_t n_max,
+	      int add_special)
+{
+	if (!qctx || !qctx->vocab || !text || (!out && n_max > 0))
+		return INT32_MIN;
 
-	if (!(model = llama_model_load_from_file(
-			path,
-			model_params)))
+	return qllm_tokenize_run(qctx, text, out, n_max, add_special);
+}
+
+const qllm_token *
+qllm_tokens(const struct qllm_context *qctx,
+	    int32_t *n_tokens)
+{
+	if (!qctx || !n_tokens)
 		return NULL;
 
-	qmap_put(model_hd, path, &model);
-	return model;
+	*n_tokens = qctx->cur_pos;
+	return qctx->token_buf;
 }
 
-struct qllm_context *
-qllm_create(const struct qllm_config *cfg)
+int
+qllm_next_token(struct qllm_context *qctx,
+		qllm_token *tok,
+		char *out,
+		size_t out_size)
 {
-	struct qllm_context *qctx;
-	struct llama_context_params ctx_params;
-	struct llama_sampler_chain_params chain_params;
-	int32_t n_threads;
+	const char *piece;
+	int32_t ret;
+	size_t n;
 
-	if (!cfg || !cfg->model_path)
-		return NULL;
+	if (!qctx || !qctx->ctx || !tok || qctx->mode == QLLM_MODE_EMBED)
+		return -1;
 
-	ctx_params = llama_context_default_params();
-	chain_params = llama_sampler_chain_default_params();
+	if (qctx->commit_off == qctx->n_commit) {
+		qctx->n_commit = qctx->commit_off = 0;
 
-	if (cfg->n_ctx > 0)
-		ctx_params.n_ctx = (uint32_t) cfg->n_ctx;
-	else
-		ctx_params.n_ctx = 512;
+		if (qctx->ended) {
+			qctx->ended = 0;
+			return 0;	/* EOG/EOS or a stop */
+		}
 
-	ctx_params.n_batch = ctx_params.n_ctx;
-	ctx_params.n_ubatch = 0;
-	ctx_params.n_seq_max = 1;
+		ret = qllm_gen_step(qctx, qctx->spec_buf);
+		qctx->text_len = qctx->text_off = 0;
+		if (ret < 0)
+			return -1;
 
-	/* Enable embeddings and mean pooling so qllm_embed() works. */
-	ctx_params.embeddings = true;
-	ctx_params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+		if (ret == 0) {
+			qctx->ended = 0;
+			return 0;
+		}
 
-	if (cfg->n_threads > 0) {
-		n_threads = cfg->n_threads;
-	} else {
-		long ncpu;
+		qctx->n_commit = ret;
+	}
 
-		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
-		if (ncpu <= 0)
-			n_threads = 1;
-		else
-			n_threads = (int32_t)(ncpu > 1 ? ncpu / 2 : 1);
+	*tok = qctx->spec_buf[qctx->commit_off++];
+	qctx->gen_seen = qctx->cur_pos - (qctx->n_commit - qctx->commit_off);
+
+	if (out && out_size) {
+		piece = qllm_piece(qctx, *tok, &n);
+		if (n >= out_size)
+			n = out_size - 1;
+		memcpy(out, piece, n);
+		out[n] = '\0';
 	}
 
-	ctx_params.n_threads = n_threads;
-	ctx_params.n_threads_batch = n_threads;
+	return 1;
+}
 
-	qctx = calloc(1, sizeof(*qctx));
-	if (!qctx)
+const char *
+qllm_token_text(const struct qllm_context *qctx,
+		qllm_token tok,
+		size_t *len)
+{
+	if (!qctx || !qctx->words || !len)
 		return NULL;
 
-	qctx->max_tokens = (int32_t)ctx_params.n_ctx;
-	qctx->params = ctx_params;	/* <-- important: save params */
-
-	qctx->model = model_load(cfg->model_path, ctx_params.n_ctx, cfg->max_offload_bytes, cfg->n_contexts);
+	return qllm_piece(qctx, tok, len);
+}
 
-	if (!qctx->model)
-		goto fail;
+/*
+ * Generate until there is whole text to hand out, ending at *end.
+ * Returns 1 if there is, 0 at the end of generation, -1 on error.
+ */
+static int
+qllm_text_fill(struct qllm_context *qctx, size_t *end)
+{
+	/* A token may be held back whole, or bring several with it. */
+	while ((*end = qllm_text_ready(qctx, qctx->ended)) == qctx->text_off) {
+		qllm_text_compact(qctx);
 
-	qctx->ctx = llama_init_from_model(qctx->model, ctx_params);
-	if (!qctx->ctx)
-		goto fail;
+		if (qctx->ended) {
+			qctx->text_len = 0;
+			return 0;	/* EOG/EOS or a stop; ended stays */
+		}
 
-	qctx->vocab = llama_model_get_vocab(qctx->model);
-	qctx->n_embd = llama_model_n_embd(qctx->model);
+		if (qllm_gen_step(qctx, qctx->spec_buf) < 0)
+			return -1;
+	}
 
-	qctx->sampler = llama_sampler_chain_init(chain_params);
-	if (!qctx->sampler)
-		goto fail;
+	return 1;
+}
 
-	llama_sampler_chain_add(qctx->sampler,
-	    llama_sampler_init_greedy());
+int
+qllm_next_cb(struct qllm_context *qctx,
+	     qllm_token_cb cb,
+	     void *user)
+{
+	size_t end, n;
+	int ret;
 
-	qctx->token_buf = calloc((size_t)qctx->max_tokens,
-	    sizeof(*qctx->token_buf));
-	qctx->seq_ids = calloc((size_t)qctx->max_tokens,
-	    sizeof(*qctx->seq_ids));
-	if (!qctx->token_buf || !qctx->seq_ids)
-		goto fail;
+	if (!qctx || !qctx->ctx || !cb || qctx->mode == QLLM_MODE_EMBED)
+		return -1;
 
-	qctx->cur_pos = 0;
+	ret = qllm_text_fill(qctx, &end);
+	if (ret <= 0) {
+		if (ret == 0) {
+			qctx->ended = 0;
+			qllm_gen_rollback(qctx);
+		}
+		return ret;
+	}
 
-	return qctx;
+	n = end - qctx->text_off;
+	qctx->text_off = end;
+	qctx->gen_out += n;
+	cb(user, qctx->text + end - n, n);
 
-fail:
-	qllm_free(qctx);
-	return NULL;
+	return n > INT_MAX ? INT_MAX : (int) n;
 }
 
-void
-qllm_free(struct qllm_context *qctx)
+int
+qllm_next(struct qllm_context *qctx,
+	  char *out,
+	  size_t out_size)
 {
-	if (!qctx)
-		return;
+	size_t end, n;
+	int ret;
 
-	if (qctx->sampler)
-		llama_sampler_free(qctx->sampler);
-	if (qctx->ctx)
-		llama_free(qctx->ctx);
-	if (qctx->model)
-		llama_model_free(qctx->model);
+	if (!qctx || !qctx->ctx || !out || out_size == 0
+	    || qctx->mode == QLLM_MODE_EMBED)
+		return -1;
 
-	free(qctx->token_buf);
-	free(qctx->seq_ids);
+	ret = qllm_text_fill(qctx, &end);
+	if (ret <= 0) {
+		if (ret == 0) {
+			qctx->ended = 0;
+			qllm_gen_rollback(qctx);
+		}
+		return ret;
+	}
 
-	free(qctx);
+	n = end - qctx->text_off;
+	if (n >= out_size) {
+		/* Cut at a code point boundary if the buffer allows. */
+		n = out_size - 1;
+		while (n && (qctx->text[qctx->text_off + n] & 0xc0) == 0x80)
+			n--;
+		if (!n)
+			n = out_size - 1;
+	}
+
+	memcpy(out, qctx->text + qctx->text_off, n);
+	out[n] = '\0';
+	qctx->text_off += n;
+	qctx->gen_out += n;
+
+	return (int) n;
 }
 
-/* Internal streaming helper: runs generation and calls cb() for each piece. */
-static int
-qllm_generate_stream_internal(struct qllm_context *qctx,
-			      const char *prompt,
-			      qllm_token_cb cb,
-			      void *user)
+size_t
+qllm_state_size(struct qllm_context *qctx)
 {
-	int32_t n_prompt;
-	llama_token tok;
-	char piece[256];
-	int n_piece;
-	int32_t step;
-	const int32_t max_gen = qctx->max_tokens;
+	if (!qctx || !qctx->ctx)
+		return 0;
 
-	if (!qctx || !prompt || !cb)
-		return -1;
+	/*
+	 * Only what the caller has seen is saved, but nothing is rolled
+	 * back before qllm_state_get(): the KV part is the current one,
+	 * which is at least as large.
+	 */
+	return sizeof(struct qllm_state_hdr)
+	    + (size_t)qllm_gen_keep(qctx) * sizeof(*qctx->token_buf)
+	    + llama_state_seq_get_size(qctx->ctx, qctx->seq_id);
+}
 
-	llama_free(qctx->ctx);
-	qctx->ctx = llama_init_from_model(qctx->model, qctx->params);
+size_t
+qllm_state_get(struct qllm_context *qctx,
+	       void *dst,
+	       size_t size)
+{
+	struct qllm_state_hdr hdr;
+	size_t tok_size, need;
+	uint8_t *p = dst;
 
-	qctx->cur_pos = 0;
+	if (!qctx || !qctx->ctx || !dst)
+		return 0;
 
-	n_prompt = llama_tokenize(qctx->vocab,
-				  prompt,
-				  (int32_t) strlen(prompt),
-				  qctx->token_buf,
-				  qctx->max_tokens,
-				  true,
-				  true);
-	if (n_prompt < 0)
-		return -1;
+	qllm_gen_reset(qctx);
+	tok_size = (size_t)qctx->cur_pos * sizeof(*qctx->token_buf);
+	hdr.magic = QLLM_STATE_MAGIC;
+	hdr.version = QLLM_STATE_VERSION;
+	hdr.n_vocab = llama_vocab_n_tokens(qctx->vocab);
+	hdr.n_tokens = qctx->cur_pos;
+	hdr.kv_size = llama_state_seq_get_size(qctx->ctx, qctx->seq_id);
 
-	if (n_prompt == 0)
+	need = sizeof(hdr) + tok_size + (size_t)hdr.kv_size;
+	if (size < need)
 		return 0;
 
-	if (qllm_decode_tokens(qctx, qctx->token_buf, n_prompt) != 0)
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+	memcpy(p, qctx->token_buf, tok_size);
+	p += tok_size;
+
+	if (llama_state_seq_get_data(qctx->ctx, p, (size_t)hdr.kv_size,
+	    qctx->seq_id) != hdr.kv_size)
+		return 0;
+
+	return need;
+}
+
+int
+qllm_state_set(struct qllm_context *qctx,
+	       const void *src,
+	       size_t size)
+{
+	struct qllm_state_hdr hdr;
+	const uint8_t *p = src;
+	llama_memory_t mem;
+	size_t tok_size;
+
+	if (!qctx || !qctx->ctx || !src || size < sizeof(hdr))
 		return -1;
 
-	for (step = 0; step < max_gen; ++step) {
-		tok = llama_sampler_sample(qctx->sampler, qctx->ctx, -1);
-		llama_sampler_accept(qctx->sampler, tok);
+	memcpy(&hdr, p, sizeof(hdr));
+	if (hdr.magic != QLLM_STATE_MAGIC
+	    || hdr.version != QLLM_STATE_VERSION
+	    || hdr.n_vocab != llama_vocab_n_tokens(qctx->vocab)
+	    || hdr.n_tokens < 0 || hdr.n_tokens > qctx->max_tokens)
+		return -1;
 
-		if (llama_vocab_is_eog(qctx->vocab, tok))
-			break;
+	tok_size = (size_t)hdr.n_tokens * sizeof(*qctx->token_buf);
+	if (size - sizeof(hdr) < tok_size
+	    || size - sizeof(hdr) - tok_size < hdr.kv_size)
+		return -1;
 
-		qctx->token_buf[0] = tok;
-		if (qllm_decode_tokens(qctx, qctx->token_buf, 1) != 0)
-			break;
+	p += sizeof(hdr);
+	mem = llama_get_memory(qctx->ctx);
+	llama_memory_seq_rm(mem, qctx->seq_id, -1, -1);
 
-		memset(piece, 0, sizeof(piece));
-		n_piece = llama_token_to_piece(qctx->vocab,
-					       tok,
-					       piece,
-					       (int) sizeof(piece),
-					       false,
-					       true);
-		if (n_piece <= 0)
-			continue;
+	qllm_gen_reset(qctx);
+	qllm_lookup_trim(qctx, 0);
+	qctx->cur_pos = 0;
+	qctx->n_pending = 0;
+	qllm_sampler_reset(qctx);
 
-		cb(user, piece, (size_t) n_piece);
+	if (!llama_state_seq_set_data(qctx->ctx, p + tok_size,
+	    (size_t)hdr.kv_size, qctx->seq_id)) {
+		llama_memory_seq_rm(mem, qctx->seq_id, -1, -1);
+		return -1;
 	}
 
+	memcpy(qctx->token_buf, p, tok_size);
+	qctx->cur_pos = hdr.n_tokens;
+	qctx->shifted = 1;	/* can't tell; keep it out of the prefix cache */
 	return 0;
 }
 
 int
-qllm_generate_stream(struct qllm_context *qctx,
-		     const char *prompt,
-		     qllm_token_cb cb,
-		     void *user)
+qllm_state_save(struct qllm_context *qctx,
+		const char *path)
 {
-	if (!qctx || !prompt || !cb)
+	size_t size;
+	void *buf;
+	FILE *fp;
+	int ret = -1;
+
+	if (!qctx || !path)
 		return -1;
 
-	return qllm_generate_stream_internal(qctx, prompt, cb, user);
-}
+	size = qllm_state_size(qctx);
+	if (!size)
+		return -1;
 
-/* Accumulator used by qllm_generate() to build a string. */
-struct qllm_accum {
-	char	*buf;
-	size_t	 cap;
-	size_t	 len;
-};
+	buf = malloc(size);
+	if (!buf)
+		return -1;
 
-static void
-qllm_accum_cb(void *user, const char *chunk, size_t len)
+	size = qllm_state_get(qctx, buf, size);
+	if (!size)
+		goto out;
+
+	fp = fopen(path, "wb");
+	if (!fp)
+		goto out;
+
+	if (fwrite(buf, 1, size, fp) == size)
+		ret = 0;
+
+	if (fclose(fp) != 0)
+		ret = -1;
+
+out:
+	free(buf);
+	return ret;
+}
+
+/* The file is mapped, so restoring costs one copy into the KV cache. */
+int
+qllm_state_load(struct qllm_context *qctx,
+		const char *path)
 {
-	struct qllm_accum *acc = user;
-	size_t n;
+	struct stat st;
+	void *map;
+	int fd, ret;
 
-	if (!acc || !acc->buf || acc->cap == 0)
-		return;
+	if (!qctx || !path)
+		return -1;
 
-	if (acc->len >= acc->cap)
-		return;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
 
-	n = len;
-	if (acc->len + n >= acc->cap) {
-		if (acc->cap <= acc->len + 1)
-			return;
-		n = acc->cap - acc->len - 1;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return -1;
 	}
 
-	if (!n)
-		return;
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
 
-	memcpy(acc->buf + acc->len, chunk, n);
-	acc->len += n;
-	acc->buf[acc->len] = '\0';
+	ret = qllm_state_set(qctx, map, (size_t)st.st_size);
+	munmap(map, (size_t)st.st_size);
+	return ret;
 }
 
-long
-qllm_generate(struct qllm_context *qctx,
-	      const char *prompt,
-	      char *out,
-	      size_t out_size)
+int
+qllm_keep(struct qllm_context *qctx,
+	  int32_t n_keep)
 {
-	struct qllm_accum acc;
-	int ret;
-
-	if (!qctx || !prompt || !out || out_size == 0)
+	if (!qctx || !qctx->ctx || qctx->n_keep < 0)
 		return -1;
 
-	out[0] = '\0';
-
-	acc.buf = out;
-	acc.cap = out_size;
-	acc.len = 0;
+	if (n_keep < 0)
+		n_keep = qctx->cur_pos + (qctx->n_pending > 0 ? qctx->n_pending : 0);
 
-	ret = qllm_generate_stream_internal(qctx,
-					    prompt,
-					    qllm_accum_cb,
-					    &acc);
-	if (ret != 0)
+	if (n_keep >= qctx->max_tokens)
 		return -1;
 
-	return (ssize_t) acc.len;
+	qctx->n_keep = n_keep;
+	return 0;
 }
 
 /*
- * qllm_embed — return a single embedding vector for the whole text.
- * Returns number of dims on success, < 0 on error.
+ * Each draw starts from a copy of the sampler, grammar and RNG, so it
+ * sees the same state and leaves the real ones as they were.
  */
 int
-qllm_embed(struct qllm_context *qctx,
-	   const char *text,
-	   float *out,
-	   size_t out_dim)
+qllm_sample_time(struct qllm_context *qctx,
+		 int32_t n,
+		 uint64_t *ns)
 {
-	int32_t n_tokens;
-	const float *embd;
+	struct llama_sampler *sampler, *grammar;
+	uint64_t t0, total = 0, rng = qctx ? qctx->rng : 0;
 	int32_t i;
+	int ret = 0;
 
-	if (!qctx || !text || !out)
+	if (!qctx || !qctx->ctx || !qctx->sampler || n <= 0 || !ns
+	    || qctx->mode == QLLM_MODE_EMBED)
 		return -1;
 
-	llama_free(qctx->ctx);
-	qctx->ctx = llama_init_from_model(qctx->model, qctx->params);
-	qctx->cur_pos = 0;
+	sampler = qctx->sampler;
+	grammar = qctx->grammar;
+
+	for (i = 0; i < n && !ret; i++) {
+		qctx->sampler = llama_sampler_clone(sampler);
+		qctx->grammar = grammar ? llama_sampler_clone(grammar) : NULL;
+
+		if (qctx->sampler && (!grammar || qctx->grammar)) {
+			t0 = qllm_now_ns();
+			qllm_sample_pick(qctx, -1);
+			total += qllm_now_ns() - t0;
+			qctx->rng = rng;
+		} else
+			ret = -1;
+
+		if (qctx->sampler)
+			llama_sampler_free(qctx->sampler);
+		if (qctx->grammar)
+			llama_sampler_free(qctx->grammar);
+	}
 
-	n_tokens = llama_tokenize(qctx->vocab,
-				  text,
-				  (int32_t) strlen(text),
-				  qctx->token_buf,
-				  qctx->max_tokens,
-				  true,
-				  true);
-	if (n_tokens < 0)
-		return -1;
+	qctx->sampler = sampler;
+	qctx->grammar = grammar;
+	*ns = total / (uint64_t) n;
+	return ret;
+}
 
-	if (n_tokens == 0)
+int
+qllm_get_stats(struct qllm_context *qctx,
+	       struct qllm_stats *st,
+	       int reset)
+{
+	if (!qctx || !st)
 		return -1;
 
-	if (qllm_decode_tokens(qctx, qctx->token_buf, n_tokens) != 0)
-		return -1;
+	*st = qctx->stats;
+	st->n_kv_used = qctx->cur_pos;
+	st->n_ctx = qctx->max_tokens;
+	if (reset)
+		memset(&qctx->stats, 0, sizeof(qctx->stats));
 
-	embd = llama_get_embeddings(qctx->ctx);
-	if (!embd)
-		return -1;
+	return 0;
+}
 
-	if (out_dim < (size_t) qctx->n_embd)
+int
+qllm_spec_stats(struct qllm_context *qctx,
+		struct qllm_spec_stats *st,
+		int reset)
+{
+	if (!qctx || !st)
 		return -1;
 
-	for (i = 0; i < qctx->n_embd; ++i)
-		out[i] = embd[i];
+	*st = qctx->spec;
+	if (reset)
+		memset(&qctx->spec, 0, sizeof(qctx->spec));
 
-	return qctx->n_embd;
+	return 0;
 }
 
 int
-qllm_prime(struct qllm_context *qctx,
-	   const char *prompt)
+qllm_set_sampling(struct qllm_context *qctx,
+		  const struct qllm_sampling *sp)
 {
-	int32_t n_prompt;
+	static const struct qllm_sampling greedy;
+	struct llama_sampler *sampler;
 
-	if (!qctx || !qctx->ctx || !prompt)
+	if (!qctx || !qctx->sampler)
 		return -1;
 
-	n_prompt = llama_tokenize(qctx->vocab,
-				  prompt,
-				  (int32_t)strlen(prompt),
-				  qctx->token_buf,
-				  qctx->max_tokens,
-				  true,
-				  true);
-	if (n_prompt < 0)
+	if (!sp)
+		sp = &greedy;
+
+	sampler = qllm_sampler_new(sp);
+	if (!sampler)
 		return -1;
 
-	if (n_prompt == 0)
+	llama_sampler_free(qctx->sampler);
+	qctx->sampler = sampler;
+	qctx->sampling = *sp;
+	qllm_rng_seed(qctx);
+	return 0;
+}
+
+int
+qllm_set_grammar(struct qllm_context *qctx,
+		 const char *gbnf)
+{
+	struct llama_sampler *grammar;
+
+	if (!qctx || !qctx->ctx || qctx->mode == QLLM_MODE_EMBED)
+		return -1;
+
+	if (!gbnf) {
+		if (qctx->grammar)
+			llama_sampler_free(qctx->grammar);
+		qctx->grammar = NULL;
 		return 0;
+	}
 
-	if (qllm_decode_tokens(qctx, qctx->token_buf, n_prompt) != 0)
+	grammar = llama_sampler_init_grammar(qctx->vocab, gbnf, "root");
+	if (!grammar)
 		return -1;
 
+	if (qctx->grammar)
+		llama_sampler_free(qctx->grammar);
+	qctx->grammar = grammar;
 	return 0;
 }
 
 int
-qllm_next(struct qllm_context *qctx,
-	  char *out,
-	  size_t out_size)
+qllm_set_json_schema(struct qllm_context *qctx,
+		     const char *schema)
 {
-	llama_token tok;
-	char piece[256];
-	int n_piece;
+	char *gbnf;
+	int ret;
 
-	if (!qctx || !qctx->ctx || !out || out_size == 0)
+	if (!schema)
+		return qllm_set_grammar(qctx, NULL);
+
+	gbnf = qllm_schema_gbnf(schema);
+	if (!gbnf)
 		return -1;
 
-	/* Sample one token */
-	tok = llama_sampler_sample(qctx->sampler, qctx->ctx, -1);
-	llama_sampler_accept(qctx->sampler, tok);
+	ret = qllm_set_grammar(qctx, gbnf);
+	free(gbnf);
+	return ret;
+}
+
+int
+qllm_set_stops(struct qllm_context *qctx,
+	       const char **stops,
+	       size_t n)
+{
+	struct qllm_stop *st;
+	int32_t *fail = NULL, *queue = NULL;
+	int32_t n_nodes = 1, u, v, c, head = 0, tail = 0;
+	size_t i, total = 0, len;
+	const unsigned char *p;
+	llama_token tok[2];
+
+	if (!qctx || !qctx->ctx)
+		return -1;
+
+	qllm_stop_free(qctx->stop);
+	qctx->stop = NULL;
 
-	/* Treat any EOG/EOS as end-of-generation */
-	if (llama_vocab_is_eog(qctx->vocab, tok))
+	for (i = 0; i < n; i++)
+		if (stops[i])
+			total += strlen(stops[i]);
+
+	if (!total)
 		return 0;
 
-	/* Advance KV with this token */
-	qctx->token_buf[0] = tok;
-	if (qllm_decode_tokens(qctx, qctx->token_buf, 1) != 0)
+	st = calloc(1, sizeof(*st));
+	if (!st)
 		return -1;
 
-	/* Convert token to text piece */
-	memset(piece, 0, sizeof(piece));
-	n_piece = llama_token_to_piece(qctx->vocab,
-				       tok,
-				       piece,
-				       (int)sizeof(piece),
-				       false,
-				       true);
-	if (n_piece <= 0)
-		return -1;
+	st->next = calloc(total + 1, sizeof(*st->next));
+	st->depth = calloc(total + 1, sizeof(*st->depth));
+	st->match = calloc(total + 1, sizeof(*st->match));
+	st->tokens = calloc(n, sizeof(*st->tokens));
+	fail = calloc(total + 1, sizeof(*fail));
+	queue = calloc(total + 1, sizeof(*queue));
+	if (!st->next || !st->depth || !st->match || !st->tokens
+	    || !fail || !queue)
+		goto fail;
+
+	/* The trie. Node 0 is the root, so 0 also means "no edge". */
+	for (i = 0; i < n; i++) {
+		if (!stops[i] || !*stops[i])
+			continue;
+
+		len = strlen(stops[i]);
+		if (len > st->max_len)
+			st->max_len = len;
+
+		u = 0;
+		for (p = (const unsigned char *)stops[i]; *p; p++) {
+			if (!st->next[u][*p]) {
+				st->depth[n_nodes] = st->depth[u] + 1;
+				st->next[u][*p] = n_nodes++;
+			}
+			u = st->next[u][*p];
+		}
+		st->match[u] = (int32_t) len;
+
+		if (llama_tokenize(qctx->vocab, stops[i], (int32_t) len,
+		    tok, 2, false, true) == 1)
+			st->tokens[st->n_tokens++] = tok[0];
+	}
+
+	/* Failure links, breadth first, folded into the edges. */
+	for (c = 0; c < 256; c++)
+		if ((v = st->next[0][c]))
+			queue[tail++] = v;
+
+	while (head < tail) {
+		u = queue[head++];
+
+		if (!st->match[u])
+			st->match[u] = st->match[fail[u]];
+
+		for (c = 0; c < 256; c++) {
+			v = st->next[u][c];
+			if (v) {
+				fail[v] = st->next[fail[u]][c];
+				queue[tail++] = v;
+			} else
+				st->next[u][c] = st->next[fail[u]][c];
+		}
+	}
 
-	if ((size_t)n_piece >= out_size)
-		n_piece = (int)(out_size - 1);
+	st->hold = malloc(st->max_len + qctx->words->piece_max);
+	if (!st->hold)
+		goto fail;
 
-	memcpy(out, piece, (size_t)n_piece);
-	out[n_piece] = '\0';
+	free(fail);
+	free(queue);
+	qctx->stop = st;
+	return 0;
 
-	return n_piece;
+fail:
+	free(fail);
+	free(queue);
+	qllm_stop_free(st);
+	return -1;
 }
@@ -0,0 +1,627 @@
+#include "./../include/ttypt/qllm.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_LENS 16
+#define MAX_METRICS 128
+#define DEFAULT_LENS "32,128,512"
+#define DEFAULT_GEN 128
+#define DEFAULT_DOCS 64
+#define DEFAULT_REPS 3
+#define DEFAULT_THRESHOLD 5.0
+#define SAMPLE_WARMUP 32	/* tokens generated before timing draws */
+#define SAMPLE_DRAWS 256	/* draws timed per repetition */
+
+static const char *filler =
+	"The quick brown fox jumps over the lazy dog while the cat "
+	"watches from the window, counting the leaves that fall. ";
+
+static const char *doc_text =
+	"Embeddings map a short passage of text to a point in a vector "
+	"space, so that passages with similar meaning end up close.";
+
+/* The sampling chain measured against greedy decoding. */
+static const struct qllm_sampling sampled = {
+	.temp = 0.8f,
+	.top_k = 40,
+	.top_p = 0.95f,
+	.min_p = 0.05f,
+	.repeat_penalty = 1.1f,
+	.seed = 42,
+};
+
+/* Sampling chains whose cost per token is measured on their own. */
+static const struct {
+	const char		*name;
+	struct qllm_sampling	 sp;
+	const char		*schema;	/* JSON schema grammar */
+} chains[] = {
+	{ "greedy", { .temp = 0.0f }, NULL },
+	{ "top_k", { .temp = 0.8f, .top_k = 40, .seed = 42 }, NULL },
+	{ "top_p_min_p", { .temp = 0.8f, .top_p = 0.95f, .min_p = 0.05f,
+	    .seed = 42 }, NULL },
+	{ "penalties", { .temp = 0.8f, .repeat_penalty = 1.1f,
+	    .presence_penalty = 0.5f, .freq_penalty = 0.5f, .seed = 42 },
+	    NULL },
+	{ "grammar", { .temp = 0.0f }, "{\"type\":\"object\"}" },
+};
+
+struct bench {
+	const char	*model;
+	int32_t		 n_ctx;
+	int32_t		 n_threads;
+	int32_t		 lens[MAX_LENS];
+	int		 n_lens;
+	int32_t		 n_gen;
+	int		 n_docs;
+	int		 reps;
+
+	qllm_token	*prompt;	/* as long as the longest length */
+	int32_t		 n_prompt;
+};
+
+struct metric {
+	char		 name[64];
+	double		 value;
+};
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Median of n samples; sorts them. */
+static double
+median(double *v, int n)
+{
+	qsort(v, (size_t) n, sizeof(*v), cmp_double);
+	return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static long
+peak_rss_kb(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return -1;
+#ifdef __APPLE__
+	return ru.ru_maxrss / 1024;	/* bytes there */
+#else
+	return ru.ru_maxrss;
+#endif
+}
+
+static struct qllm_context *
+bench_ctx(const struct bench *b, enum qllm_mode mode)
+{
+	struct qllm_config cfg = {
+		.model_path = b->model,
+		.n_ctx = b->n_ctx,
+		.n_threads = b->n_threads,
+		.mode = mode,
+	};
+
+	return qllm_create(&cfg);
+}
+
+/* Tokenize repeated filler until it covers the longest length. */
+static int
+bench_prompt(struct bench *b, struct qllm_context *ctx)
+{
+	int32_t need = 0, n;
+	size_t flen = strlen(filler), reps = 8, i;
+	char *text;
+	int k;
+
+	for (k = 0; k < b->n_lens; k++)
+		if (b->lens[k] > need)
+			need = b->lens[k];
+
+	for (;;) {
+		/* Never more tokens than bytes, plus BOS and the like. */
+		text = malloc(flen * reps + 1);
+		free(b->prompt);
+		b->prompt = malloc((flen * reps + 8) * sizeof(*b->prompt));
+		if (!text || !b->prompt) {
+			free(text);
+			return -1;
+		}
+
+		for (i = 0; i < reps; i++)
+			memcpy(text + i * flen, filler, flen);
+		text[flen * reps] = '\0';
+
+		n = qllm_tokenize(ctx, text, b->prompt,
+		    (int32_t) (flen * reps + 8), 1);
+		free(text);
+		if (n < 0)
+			return -1;
+		if (n >= need) {
+			b->n_prompt = n;
+			return 0;
+		}
+
+		reps *= 2;
+	}
+}
+
+/*
+ * Time prefill of n prompt tokens on a fresh context, and the first
+ * token after it.
+ */
+static int
+bench_prefill(const struct bench *b, int32_t n,
+	      double *prefill_ms, double *ttft_ms)
+{
+	struct qllm_context *ctx;
+	qllm_token tok;
+	double t0, t1;
+	int ret = -1;
+
+	ctx = bench_ctx(b, QLLM_MODE_GENERATE);
+	if (!ctx)
+		return -1;
+
+	t0 = now_ms();
+	if (qllm_prime_tokens(ctx, b->prompt, n) != 0)
+		goto out;
+	t1 = now_ms();
+	if (qllm_next_token(ctx, &tok, NULL, 0) < 0)
+		goto out;
+
+	*prefill_ms = t1 - t0;
+	*ttft_ms = now_ms() - t0;
+	ret = 0;
+out:
+	qllm_free(ctx);
+	return ret;
+}
+
+/*
+ * Time n_gen generated tokens after a short prompt. Whenever the model
+ * ends its reply, the prompt is fed again, outside the clock. If it
+ * ends one before its first token, it would every time: that fails.
+ */
+static int
+bench_decode(const struct bench *b, const struct qllm_sampling *sp,
+	     double *tps)
+{
+	struct qllm_context *ctx;
+	int32_t n_short = b->lens[0], done = 0, before;
+	double spent = 0, t0;
+	qllm_token tok;
+	int ret = -1, r = 0;
+
+	ctx = bench_ctx(b, QLLM_MODE_GENERATE);
+	if (!ctx)
+		return -1;
+
+	if (sp && qllm_set_sampling(ctx, sp) != 0)
+		goto out;
+
+	while (done < b->n_gen) {
+		if (qllm_prime_tokens(ctx, b->prompt, n_short) != 0)
+			goto out;
+
+		before = done;
+		t0 = now_ms();
+		while (done < b->n_gen
+		       && (r = qllm_next_token(ctx, &tok, NULL, 0)) > 0)
+			done++;
+		spent += now_ms() - t0;
+
+		if (r < 0 || done == before) {
+			fprintf(stderr, "qllm-bench: the model ends its reply"
+			    " at once\n");
+			goto out;
+		}
+	}
+
+	*tps = spent > 0 ? done * 1e3 / spent : 0;
+	ret = 0;
+out:
+	qllm_free(ctx);
+	return ret;
+}
+
+/*
+ * Time one draw of the sampling chain c alone, on the fixed logits left
+ * after a prompt and a few generated tokens (so penalties have a
+ * history to go through).
+ */
+static int
+bench_sample(const struct bench *b, size_t c, double *us)
+{
+	struct qllm_context *ctx;
+	qllm_token tok;
+	uint64_t ns;
+	int ret = -1, i;
+
+	ctx = bench_ctx(b, QLLM_MODE_GENERATE);
+	if (!ctx)
+		return -1;
+
+	if (qllm_set_sampling(ctx, &chains[c].sp) != 0
+	    || (chains[c].schema
+	    && qllm_set_json_schema(ctx, chains[c].schema) != 0))
+		goto out;
+
+	if (qllm_prime_tokens(ctx, b->prompt, b->lens[0]) != 0)
+		goto out;
+
+	for (i = 0; i < SAMPLE_WARMUP; i++)
+		if (qllm_next_token(ctx, &tok, NULL, 0) <= 0)
+			break;
+
+	if (qllm_sample_time(ctx, SAMPLE_DRAWS, &ns) != 0)
+		goto out;
+
+	*us = ns / 1e3;
+	ret = 0;
+out:
+	qllm_free(ctx);
+	return ret;
+}
+
+static int
+bench_embed(const struct bench *b, double *docs_s)
+{
+	struct qllm_context *ctx;
+	const char **docs = NULL;
+	float *vec = NULL, probe[16384];
+	double t0;
+	int dim, i, ret = -1;
+
+	ctx = bench_ctx(b, QLLM_MODE_EMBED);
+	if (!ctx)
+		return -1;
+
+	dim = qllm_embed(ctx, doc_text, probe, sizeof(probe) / sizeof(*probe));
+	if (dim <= 0)
+		goto out;
+
+	docs = calloc((size_t) b->n_docs, sizeof(*docs));
+	vec = calloc((size_t) b->n_docs * (size_t) dim, sizeof(*vec));
+	if (!docs || !vec)
+		goto out;
+
+	for (i = 0; i < b->n_docs; i++)
+		docs[i] = doc_text;
+
+	t0 = now_ms();
+	if (qllm_embed_batch(ctx, docs, (size_t) b->n_docs, vec,
+	    (size_t) dim) <= 0)
+		goto out;
+
+	*docs_s = b->n_docs * 1e3 / (now_ms() - t0);
+	ret = 0;
+out:
+	free(docs);
+	free(vec);
+	qllm_free(ctx);
+	return ret;
+}
+
+/* s as a JSON string. */
+static void
+json_str(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s; s++)
+		if (*s == '"' || *s == '\\')
+			fprintf(out, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(out, "\\u%04x", (unsigned char) *s);
+		else
+			fputc(*s, out);
+	fputc('"', out);
+}
+
+static int
+bench_run(struct bench *b, FILE *out)
+{
+	struct qllm_context *ctx;
+	struct qllm_model *model;
+	double load_ms, pre[DEFAULT_REPS * 8], ttft[DEFAULT_REPS * 8];
+	double greedy[DEFAULT_REPS * 8], samp[DEFAULT_REPS * 8];
+	double tps, tps_s, docs[DEFAULT_REPS * 8], docs_s = 0;
+	double draw[DEFAULT_REPS * 8];
+	int k, r, embed_ok = 1;
+	size_t c;
+
+	/* Cold load, then keep the weights for every context after it. */
+	load_ms = now_ms();
+	ctx = bench_ctx(b, QLLM_MODE_GENERATE);
+	load_ms = now_ms() - load_ms;
+	if (!ctx) {
+		fprintf(stderr, "qllm-bench: can't load %s\n", b->model);
+		return -1;
+	}
+
+	model = qllm_model_retain(ctx);
+	if (!model || bench_prompt(b, ctx) != 0) {
+		fprintf(stderr, "qllm-bench: can't tokenize\n");
+		qllm_free(ctx);
+		return -1;
+	}
+	qllm_free(ctx);
+
+	fprintf(out, "{\n\t\"model\": ");
+	json_str(out, b->model);
+	fprintf(out, ",\n");
+	fprintf(out, "\t\"threads\": %d,\n\t\"ctx\": %d,\n\t\"reps\": %d,\n",
+	    b->n_threads, b->n_ctx, b->reps);
+	fprintf(out, "\t\"load_ms\": %.3f,\n", load_ms);
+
+	for (k = 0; k < b->n_lens; k++) {
+		for (r = 0; r < b->reps; r++)
+			if (bench_prefill(b, b->lens[k], &pre[r], &ttft[r]))
+				goto fail;
+
+		fprintf(out, "\t\"prefill_%d_tps\": %.3f,\n", b->lens[k],
+		    b->lens[k] * 1e3 / median(pre, b->reps));
+		fprintf(out, "\t\"ttft_%d_ms\": %.3f,\n", b->lens[k],
+		    median(ttft, b->reps));
+	}
+
+	for (r = 0; r < b->reps; r++)
+		if (bench_decode(b, NULL, &greedy[r])
+		    || bench_decode(b, &sampled, &samp[r]))
+			goto fail;
+
+	tps = median(greedy, b->reps);
+	tps_s = median(samp, b->reps);
+	fprintf(out, "\t\"decode_tps\": %.3f,\n", tps);
+	fprintf(out, "\t\"decode_sampled_tps\": %.3f,\n", tps_s);
+
+	for (c = 0; c < sizeof(chains) / sizeof(*chains); c++) {
+		for (r = 0; r < b->reps; r++)
+			if (bench_sample(b, c, &draw[r]))
+				goto fail;
+
+		fprintf(out, "\t\"sample_%s_us\": %.3f,\n", chains[c].name,
+		    median(draw, b->reps));
+	}
+
+	for (r = 0; r < b->reps && embed_ok; r++)
+		embed_ok = !bench_embed(b, &docs[r]);
+	if (embed_ok) {
+		docs_s = median(docs, b->reps);
+		fprintf(out, "\t\"embed_docs_s\": %.3f,\n", docs_s);
+	}
+
+	fprintf(out, "\t\"peak_rss_kb\": %ld\n}\n", peak_rss_kb());
+	qllm_model_release(model);
+	return 0;
+
+fail:
+	fprintf(stderr, "qllm-bench: generation failed\n");
+	qllm_model_release(model);
+	return -1;
+}
+
+/* Lower is better for times and sizes, higher for rates. */
+static int
+metric_dir(const char *name)
+{
+	size_t n = strlen(name);
+	static const char *lower[] = { "_ms", "_us", "_kb" };
+	static const char *higher[] = { "_tps", "_docs_s" };
+	size_t i, m;
+
+	for (i = 0; i < sizeof(lower) / sizeof(*lower); i++) {
+		m = strlen(lower[i]);
+		if (n > m && !strcmp(name + n - m, lower[i]))
+			return -1;
+	}
+
+	for (i = 0; i < sizeof(higher) / sizeof(*higher); i++) {
+		m = strlen(higher[i]);
+		if (n > m && !strcmp(name + n - m, higher[i]))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Read the numeric members of a flat JSON object written by us. */
+static int
+metrics_load(const char *path, struct metric *m, int max)
+{
+	char line[BUFSIZ], *p, *q, *end;
+	int n = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		return -1;
+	}
+
+	while (n < max && fgets(line, sizeof(line), fp)) {
+		p = strchr(line, '"');
+		if (!p || !(q = strchr(++p, '"')) || (size_t) (q - p)
+		    >= sizeof(m->name))
+			continue;
+
+		memcpy(m[n].name, p, (size_t) (q - p));
+		m[n].name[q - p] = '\0';
+
+		p = strchr(q, ':');
+		if (!p || !metric_dir(m[n].name))
+			continue;
+
+		m[n].value = strtod(p + 1, &end);
+		if (end != p + 1)
+			n++;
+	}
+
+	fclose(fp);
+	return n;
+}
+
+static int
+compare(const char *base_path, const char *new_path, double threshold)
+{
+	struct metric base[MAX_METRICS], cur[MAX_METRICS];
+	int n_base, n_cur, i, j, dir, bad, n_bad = 0, first = 1;
+	double change;
+
+	n_base = metrics_load(base_path, base, MAX_METRICS);
+	n_cur = metrics_load(new_path, cur, MAX_METRICS);
+	if (n_base < 0 || n_cur < 0)
+		return 2;
+
+	printf("{\n\t\"threshold_pct\": %.2f,\n\t\"metrics\": [", threshold);
+
+	for (i = 0; i < n_cur; i++) {
+		for (j = 0; j < n_base; j++)
+			if (!strcmp(base[j].name, cur[i].name))
+				break;
+		if (j == n_base || base[j].value == 0)
+			continue;
+
+		dir = metric_dir(cur[i].name);
+		change = (cur[i].value - base[j].value) * 100
+		    / fabs(base[j].value);
+		bad = change * dir < -threshold;
+		n_bad += bad;
+
+		printf("%s\n\t\t{ \"name\": \"%s\", \"base\": %.3f, "
+		    "\"new\": %.3f, \"change_pct\": %.2f, "
+		    "\"regression\": %s }", first ? "" : ",",
+		    cur[i].name, base[j].value, cur[i].value, change,
+		    bad ? "true" : "false");
+		first = 0;
+	}
+
+	printf("\n\t],\n\t\"regressions\": %d\n}\n", n_bad);
+	return n_bad ? 1 : 0;
+}
+
+static int
+parse_lens(struct bench *b, char *arg)
+{
+	char *tok, *save = NULL;
+
+	b->n_lens = 0;
+	for (tok = strtok_r(arg, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (b->n_lens == MAX_LENS || atoi(tok) <= 0)
+			return -1;
+		b->lens[b->n_lens++] = atoi(tok);
+	}
+
+	return b->n_lens ? 0 : -1;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	    "Usage: %s [-c n_ctx] [-t threads] [-p len,...] [-n n_gen]\n"
+	    "       [-e n_docs] [-r reps] [-o out.json] model.gguf\n"
+	    "       %s -C [-T pct] base.json new.json\n"
+	    "\n"
+	    "  -p  prompt lengths to prefill (default " DEFAULT_LENS ")\n"
+	    "  -n  tokens to decode (default %d)\n"
+	    "  -e  documents to embed (default %d)\n"
+	    "  -r  repetitions, the median is reported (default %d)\n"
+	    "  -C  compare two results; exit 1 on a regression\n"
+	    "  -T  regression threshold in percent (default %.0f)\n",
+	    prog, prog, DEFAULT_GEN, DEFAULT_DOCS, DEFAULT_REPS,
+	    DEFAULT_THRESHOLD);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char lens[] = DEFAULT_LENS;
+	struct bench b = {
+		.n_gen = DEFAULT_GEN,
+		.n_docs = DEFAULT_DOCS,
+		.reps = DEFAULT_REPS,
+	};
+	double threshold = DEFAULT_THRESHOLD;
+	const char *out_path = NULL;
+	int c, cmp = 0, k, ret;
+	FILE *out = stdout;
+
+	parse_lens(&b, lens);
+
+	while ((c = getopt(argc, argv, "c:t:p:n:e:r:o:CT:")) != -1) {
+		switch (c) {
+		case 'c': b.n_ctx = atoi(optarg); break;
+		case 't': b.n_threads = atoi(optarg); break;
+		case 'p':
+			if (parse_lens(&b, optarg) != 0) {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		case 'n': b.n_gen = atoi(optarg); break;
+		case 'e': b.n_docs = atoi(optarg); break;
+		case 'r': b.reps = atoi(optarg); break;
+		case 'o': out_path = optarg; break;
+		case 'C': cmp = 1; break;
+		case 'T': threshold = atof(optarg); break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (cmp) {
+		if (argc - optind != 2) {
+			usage(argv[0]);
+			return 2;
+		}
+		return compare(argv[optind], argv[optind + 1], threshold);
+	}
+
+	if (argc - optind != 1 || b.n_gen <= 0 || b.n_docs <= 0
+	    || b.reps <= 0 || b.reps > DEFAULT_REPS * 8) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	b.model = argv[optind];
+
+	/* Room for the longest prompt and what decoding adds to it. */
+	if (!b.n_ctx) {
+		b.n_ctx = 2048;
+		for (k = 0; k < b.n_lens; k++)
+			while (b.n_ctx < b.lens[k] + b.lens[0] + b.n_gen + 16)
+				b.n_ctx *= 2;
+	}
+
+	if (out_path && !(out = fopen(out_path, "w"))) {
+		perror(out_path);
+		return 2;
+	}
+
+	ret = bench_run(&b, out);
+	if (out != stdout)
+		fclose(out);
+	free(b.prompt);
+	return ret ? 1 : 0;
+}
@@ -3,26 +3,81 @@
 #include <ttypt/qsys.h>
 #include "./../include/ttypt/qllm.h"
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #define DEFAULT_SEQ_MAX 4
 #define MAX_TOKENS 1024
 #define MAX_MEMORY (MAX_TOKENS * 10)
+#define STEP_TOKENS 128
 #define FEAT_GENERAL 0
+#define OUT_FLUSH 1024		/* bytes buffered before a write */
+#define OUT_DELAY 15		/* ms the first buffered byte may wait */
+#define HIST_SUB_BITS 3		/* 8 buckets per power of two, ~12% apart */
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
 
 struct qllm_context;
 
 typedef struct fd_info {
 	char			line_buf[BUFSIZ * 4];
 	struct qllm_context *	ctx;
-	unsigned		end_pos;
 	unsigned		line_pos;
+	unsigned		steps;
+	int			active;	/* scheduled for qllm_step() */
+	int			reply;	/* client waits for a reply */
+	int			stop;
+	char			out_buf[OUT_FLUSH];
+	size_t			out_len;
+	unsigned long long	out_since;	/* ms, first byte buffered */
+	unsigned long long	accept_at;	/* us, connected; 0 once replied */
+	unsigned long long	ask_at;		/* us, reply requested */
+	unsigned long long	piece_at;	/* us, last piece generated */
+	int			got_piece;
 } fdi_t;
 
+/*
+ * HDR-style histogram: log-linear buckets, so any value is counted
+ * within one bucket width (1 / HIST_SUB of its power of two) of where
+ * it is. Updates are relaxed atomics, no locks.
+ */
+struct hist {
+	const char		*name;
+	const char		*help;
+	double			 scale;		/* recorded units per exported */
+	uint64_t		 counts[HIST_BUCKETS];
+	uint64_t		 count;
+	uint64_t		 sum;
+};
+
+enum {
+	H_FIRST_BYTE,
+	H_PROMPT,
+	H_TTFT,
+	H_GAP,
+	H_REPLY,
+	H_MAX,
+};
+
+static struct hist hists[H_MAX] = {
+	[H_FIRST_BYTE] = { "qllmd_first_byte_seconds",
+		"From accepting a connection to the first reply byte sent"
+		" on it", 1e6 },
+	[H_PROMPT] = { "qllmd_prompt_tokens",
+		"Prompt size of a request", 1 },
+	[H_TTFT] = { "qllmd_ttft_seconds",
+		"From a request to its first generated text", 1e6 },
+	[H_GAP] = { "qllmd_token_gap_seconds",
+		"Between generated pieces of a reply", 1e6 },
+	[H_REPLY] = { "qllmd_reply_seconds",
+		"From a request to the end of its reply", 1e6 },
+};
+
 fdi_t fdis[FD_SETSIZE], general;
 
 const char *start = "<|im_start|>";
@@ -33,26 +88,31 @@ const unsigned end_len = 10;
 size_t crb_len = 0;
 char *crb = NULL;
 
-static char qllm_model_path[BUFSIZ];
+struct qllm_cache *prefix_cache = NULL;
+size_t cache_mb = 256;
 
-typedef struct gen_state {
-	int	fd;
-	fdi_t *fdi;
-	int	stop;
-} gen_state_t;
+/* One context; every session is a sequence of it. */
+struct qllm_context *pool = NULL;
+
+static struct qllm_context *step_seqs[FD_SETSIZE];
+static void *step_users[FD_SETSIZE];
+static int step_next;		/* round-robin start fd */
+unsigned step_tokens = STEP_TOKENS;
+
+static char qllm_model_path[BUFSIZ];
 
 struct ndc_config ndc_config = {
-	.flags = NDC_DETACH,
+	.flags = NDC_DETACH | NDC_WAKE,
 	.port = 4242,
 };
 
-#if FEAT_GENERAL
-unsigned n_contexts = 2;
-#else
-unsigned n_contexts = 1;
-#endif
+unsigned n_contexts = DEFAULT_SEQ_MAX;
 unsigned n_ctx = 0;
 
+/* CPU threads; a pool is made only if any of it is set. */
+struct qllm_threadpool_config tp_cfg;
+struct qllm_threadpool *tp = NULL;
+
 static inline void
 append_to_line(fdi_t *fdi, const char *s, size_t len)
 {
@@ -73,11 +133,143 @@ append_to_line(fdi_t *fdi, const char *s, size_t len)
 	fdi->line_buf[fdi->line_pos] = '\0';
 }
 
+static unsigned long long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000ULL
+		+ (unsigned long long) ts.tv_nsec / 1000000ULL;
+}
+
+static unsigned long long
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000ULL
+		+ (unsigned long long) ts.tv_nsec / 1000ULL;
+}
+
+static inline unsigned
+hist_bucket(uint64_t v)
+{
+	unsigned e;
+
+	if (v < HIST_SUB)
+		return (unsigned) v;
+
+	e = 63 - (unsigned) __builtin_clzll(v);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB
+		+ (unsigned) ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Highest value counted in bucket i. */
+static inline uint64_t
+hist_value(unsigned i)
+{
+	unsigned e;
+
+	if (i < HIST_SUB)
+		return i;
+
+	e = i / HIST_SUB + HIST_SUB_BITS - 1;
+	return (((uint64_t) (HIST_SUB + i % HIST_SUB) + 1)
+		<< (e - HIST_SUB_BITS)) - 1;
+}
+
+static inline void
+hist_add(int h, uint64_t v)
+{
+	struct hist *hi = &hists[h];
+
+	__atomic_fetch_add(&hi->counts[hist_bucket(v)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hi->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hi->sum, v, __ATOMIC_RELAXED);
+}
+
+/* Smallest bucket value at or above a q share of the samples. */
+static uint64_t
+hist_quantile(const struct hist *hi, double q)
+{
+	uint64_t total, want, seen = 0;
+	unsigned i;
+
+	total = __atomic_load_n(&hi->count, __ATOMIC_RELAXED);
+	if (!total)
+		return 0;
+
+	want = (uint64_t) (q * (double) total);
+	if (want < 1)
+		want = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&hi->counts[i], __ATOMIC_RELAXED);
+		if (seen >= want)
+			return hist_value(i);
+	}
+
+	return hist_value(HIST_BUCKETS - 1);
+}
+
+/*
+ * Send what a session has buffered in one write.
+ * ndc_write() is the only way out that also covers TLS sessions, so
+ * this coalesces into a single buffer rather than using writev().
+ */
+static inline void
+out_flush(int fd, fdi_t *fdi)
+{
+	uint64_t t0;
+
+	if (!fdi->out_len)
+		return;
+
+	if (fdi->reply && fdi->accept_at) {
+		hist_add(H_FIRST_BYTE, now_us() - fdi->accept_at);
+		fdi->accept_at = 0;
+	}
+
+	t0 = qllm_trace_begin();
+	ndc_write(fd, fdi->out_buf, fdi->out_len);
+	qllm_trace_end("write", t0, (int64_t) fdi->out_len);
+	fdi->out_len = 0;
+}
+
+/*
+ * Queue reply text for a session. It goes out once OUT_FLUSH bytes
+ * pile up, OUT_DELAY ms after the oldest one (see ndc_update()), or
+ * at the end of the reply.
+ */
+static inline void
+out_write(int fd, fdi_t *fdi, const char *s, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		if (!fdi->out_len)
+			fdi->out_since = now_ms();
+
+		n = sizeof(fdi->out_buf) - fdi->out_len;
+		if (n > len)
+			n = len;
+
+		memcpy(fdi->out_buf + fdi->out_len, s, n);
+		fdi->out_len += n;
+		s += n;
+		len -= n;
+
+		if (fdi->out_len == sizeof(fdi->out_buf))
+			out_flush(fd, fdi);
+	}
+}
+
 static inline void
 reset_fdi(fdi_t *fdi)
 {
 	fdi->line_pos = 0;
-	fdi->end_pos = 0;
 	memset(fdi->line_buf, 0, sizeof(fdi->line_buf));
 }
 
@@ -106,6 +298,9 @@ cmd_exec(int fd, fdi_t *fdi)
 	if (!pound)
 		return;
 
+	/* Command output goes straight out; keep it in order. */
+	out_flush(fd, fdi);
+
 	snprintf(argsbuf, sizeof(argsbuf), "%s", pound + 2);
 	space = argsbuf;
 
@@ -129,120 +324,273 @@ cmd_exec(int fd, fdi_t *fdi)
 }
 
 /*
- * Process a text chunk from qllm and stream it to the client,
- * handling:
- *  - detection of the "<|im_end|>" marker (not printed),
- *  - line buffering and command execution on newline.
+ * Stream one generated piece to the client. libqllm stops before the
+ * end marker, so it never shows up here.
  */
 static inline void
-process_chunk(gen_state_t *st, const char *chunk, size_t len)
+inference(int fd, fdi_t *fdi, const char *piece, size_t len)
 {
-	fdi_t *fdi = st->fdi;
-	int fd = st->fd;
+	out_write(fd, fdi, piece, len);
+	append_to_line(fdi, piece, len);
 
-	for (size_t i = 0; i < len; ++i) {
-		char ch = chunk[i];
+	if (memchr(piece, '\n', len)) {
+		cmd_exec(fd, fdi);
+		fdi->line_pos = 0;
+	}
+}
 
-		/* Normal character */
-		ndc_write(fd, &ch, 1);
-		append_to_line(fdi, &ch, 1);
+static void
+step_cb(void *user, const char *chunk, size_t len)
+{
+	fdi_t *fdi = user;
+	unsigned long long now;
 
-        /* Command execution on newline */
-		if (ch == '\n') {
-			cmd_exec(fd, fdi);
-			reset_fdi(fdi);
-		}
+	if (fdi->stop)
+		return;
+
+	if (fdi->reply) {
+		now = now_us();
+		hist_add(fdi->got_piece ? H_GAP : H_TTFT,
+		    now - (fdi->got_piece ? fdi->piece_at : fdi->ask_at));
+		fdi->piece_at = now;
+		fdi->got_piece = 1;
 	}
+
+	inference((int)(fdi - fdis), fdi, chunk, len);
 }
 
+static void
+reply_end(int fd, fdi_t *fdi)
+{
+	cmd_exec(fd, fdi);
+	fdi->line_pos = 0;
+	fdi->stop = 0;
+	out_write(fd, fdi, end, end_len);
+	out_write(fd, fdi, "\n", 1);
+	out_flush(fd, fdi);
+	fdi->reply = 0;
+	hist_add(H_REPLY, now_us() - fdi->ask_at);
+}
 
-static inline int
-inference(int fd, fdi_t *fdi)
+/*
+ * Scheduler tick, run once per event loop turn. Every scheduled
+ * session contributes to one batched decode of at most step_tokens
+ * tokens, so long prompts are prefilled over several turns and the
+ * loop keeps accepting and serving clients in between. The starting
+ * session rotates so nobody is starved when the budget runs out.
+ */
+void
+ndc_update(unsigned long long dt __attribute__((unused)))
 {
-	char	buf[MAX_MEMORY];
-	int	ret;
-	size_t	buflen;
-	char	*eoim;
+	unsigned long long now;
+	fdi_t *fdi;
+	size_t n = 0, i;
+	int fd, k, ret;
 
-	/* Get next piece of text from qllm */
-	ret = qllm_next(fdi->ctx, buf, sizeof(buf));
-	if (ret < 0)
-		return 0;	/* error -> stop */
+	for (k = 0; k < FD_SETSIZE; k++) {
+		fd = (step_next + k) % FD_SETSIZE;
 
-	if (ret == 0)
-		return 0;	/* EOS -> stop */
+		if (!fdis[fd].active)
+			continue;
 
-	buflen = (size_t)ret;
+		step_seqs[n] = fdis[fd].ctx;
+		step_users[n] = &fdis[fd];
+		n++;
+	}
 
-	/* Mesma lógica de antes para detectar "<|im_end|>" */
-	eoim = strchr(buf, *(end + fdi->end_pos));
-	if (eoim && (eoim - buf) <= end_len - fdi->end_pos) {
-		size_t clen = buflen - (size_t)(eoim - buf);
+	if (!n)
+		return;
 
-		if (strncmp(eoim, end + fdi->end_pos, clen))
-			goto end;
+	step_next = ((int)((fdi_t *) step_users[0] - fdis) + 1) % FD_SETSIZE;
 
-		fdi->end_pos += clen;
+	ret = qllm_step(step_seqs, n, (int32_t) step_tokens,
+			step_cb, step_users);
+	if (ret < 0)
+		qsyslog(QLOG_ERR, "qllm_step failed\n");
 
-		if (fdi->end_pos < end_len)
-			return 1;
+	now = now_ms();
 
-		fdi->end_pos = 0;
-		return 0;
-	}
+	for (i = 0; i < n; i++) {
+		fdi = step_users[i];
+		fd = (int)(fdi - fdis);
+
+		if (fdi->out_len && now - fdi->out_since >= OUT_DELAY)
+			out_flush(fd, fdi);
+
+		if (fdi->reply && ++fdi->steps >= MAX_MEMORY)
+			fdi->stop = 1;
 
-end:
-	if (fdi->end_pos) {
-		ndc_write(fd, (void *)end, fdi->end_pos);
-		append_to_line(fdi, end, fdi->end_pos);
-		fdi->end_pos = 0;
+		if (ret >= 0 && !fdi->stop && qllm_seq_busy(fdi->ctx))
+			continue;
+
+		fdi->active = 0;
+		if (fdi->reply)
+			reply_end(fd, fdi);
 	}
+}
 
-	ndc_write(fd, buf, buflen);
-	append_to_line(fdi, buf, buflen);
+/* Read a whole file into a NUL terminated buffer. */
+static char *
+slurp(const char *path)
+{
+	struct stat st;
+	char *buf;
+	FILE *fp;
 
-	if (strrchr(buf, '\n')) {
-		cmd_exec(fd, fdi);
-		fdi->line_pos = 0;
+	fp = fopen(path, "r");
+	if (!fp)
+		return NULL;
+
+	if (fstat(fileno(fp), &st) != 0 || st.st_size < 0) {
+		fclose(fp);
+		return NULL;
 	}
 
-	return 1;
+	buf = malloc((size_t) st.st_size + 1);
+	if (buf)
+		buf[fread(buf, 1, (size_t) st.st_size, fp)] = '\0';
+
+	fclose(fp);
+	return buf;
 }
 
-void
-generate(int fd, const char *prompt)
+/*
+ * Constrain a reply to grammar NAME: "json" for any JSON object,
+ * otherwise NAME.gbnf or a JSON schema in NAME.json, relative to the
+ * working directory (see -C).
+ */
+static int
+set_grammar(struct qllm_context *ctx, const char *name)
 {
-	fdi_t	*fdi = &fdis[fd];
-	int	 step;
-	int	 max_gen = MAX_MEMORY;
+	char path[BUFSIZ], *text;
+	const char *c;
+	int ret;
 
-	/* Prime qllm context with the full prompt */
-	if (qllm_prime(fdi->ctx, prompt) < 0) {
-		qsyslog(QLOG_ERR, "qllm_prime failed\n");
-		return;
+	if (!name)
+		return qllm_set_grammar(ctx, NULL);
+
+	if (!strcmp(name, "json"))
+		return qllm_set_json_schema(ctx, "{\"type\":\"object\"}");
+
+	for (c = name; *c; c++)
+		if (!isalnum((unsigned char) *c) && *c != '_' && *c != '-')
+			return -1;
+
+	snprintf(path, sizeof(path), "%s.gbnf", name);
+	text = slurp(path);
+	if (text) {
+		ret = qllm_set_grammar(ctx, text);
+		free(text);
+		return ret;
 	}
 
-	fdi->line_pos = 0;
-	fdi->end_pos = 0;
+	snprintf(path, sizeof(path), "%s.json", name);
+	text = slurp(path);
+	if (!text)
+		return -1;
 
-	for (step = 0;
-	     step < max_gen && inference(fd, fdi);
-	     ++step)
-		;
+	ret = qllm_set_json_schema(ctx, text);
+	free(text);
+	return ret;
+}
 
-	cmd_exec(fd, fdi);
-	fdi->line_pos = 0;
+/*
+ * Leading "-t 0.7 -k 40 ..." words of an ask set its sampling and
+ * grammar. Only those letters are options: the first word that is not
+ * one (like "-5" or "--help") starts the question, and so does the word
+ * after "--". Returns the index of the first word of the question, or
+ * -1 on an option with a bad value.
+ */
+static int
+ask_opts(int argc, char *argv[], struct qllm_sampling *sp,
+	 const char **grammar)
+{
+	char *arg, *e;
+	int i;
+
+	for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+		if (!strcmp(argv[i], "--"))
+			return i + 1;
+
+		if (argv[i][1] == '\0' || argv[i][2] != '\0'
+		    || !strchr("gtkpmrPs", argv[i][1]))
+			break;
+
+		arg = argv[i + 1];
+		e = "";
+		switch (argv[i][1]) {
+		case 'g':
+			*grammar = arg;
+			break;
+		case 't':
+			sp->temp = strtof(arg, &e);
+			break;
+		case 'k':
+			sp->top_k = (int32_t) strtol(arg, &e, 10);
+			break;
+		case 'p':
+			sp->top_p = strtof(arg, &e);
+			break;
+		case 'm':
+			sp->min_p = strtof(arg, &e);
+			break;
+		case 'r':
+			sp->repeat_penalty = strtof(arg, &e);
+			break;
+		case 'P':
+			sp->presence_penalty = strtof(arg, &e);
+			break;
+		case 's':
+			sp->seed = (uint32_t) strtoul(arg, &e, 10);
+			break;
+		default:
+			return -1;
+		}
+
+		if (e == arg || *e != '\0')
+			return -1;
+	}
+
+	return i;
 }
 
 void
 do_ASK(int fd, int argc, char *argv[])
 {
-	fdi_t *fdi __attribute__((unused)) = &fdis[fd];
+	fdi_t *fdi = &fdis[fd];
+	struct qllm_sampling sp = { 0 };
+	struct qllm_stats before, after;
+	const char *grammar = NULL;
 	char buf[BUFSIZ * 2], *b = buf;
-	int i, ret;
+	unsigned long long at = now_us();
+	int i, ret, first;
+
+	if (fdi->reply) {
+		out_flush(fd, fdi);
+		ndc_writef(fd, "Busy\n%s\n", end);
+		return;
+	}
+
+	first = ask_opts(argc, argv, &sp, &grammar);
+	if (first < 0) {
+		ndc_writef(fd, "Usage: ask [-t TEMP] [-k TOP_K] [-p TOP_P]"
+		    " [-m MIN_P] [-r REPEAT] [-P PRESENCE] [-s SEED]"
+		    " [-g GRAMMAR] TEXT\n%s\n", end);
+		return;
+	}
+
+	if (qllm_set_sampling(fdi->ctx, &sp) < 0) {
+		ndc_writef(fd, "%s\n", end);
+		return;
+	}
+
+	if (set_grammar(fdi->ctx, grammar) < 0) {
+		ndc_writef(fd, "Bad grammar\n%s\n", end);
+		return;
+	}
 
 	b += snprintf(b, sizeof(buf) - (b - buf), "%suser\n", start);
-	for (i = 1; i < argc; i++) {
+	for (i = first; i < argc; i++) {
 		ret = snprintf(b, sizeof(buf) - (b - buf), " %s", argv[i]);
 		if (ret < 0 || (size_t)ret >= sizeof(buf) - (size_t)(b - buf)) {
 			ndc_writef(fd, "Buffer size exceeded\n");
@@ -252,36 +600,178 @@ do_ASK(int fd, int argc, char *argv[])
 	}
 	b += snprintf(b, sizeof(buf) - (b - buf), "%s\n%sassistant\n ", end, start);
 
-	generate(fd, buf);
-	ndc_writef(fd, "%s\n", end);
+	/* Queue it; ndc_update() generates the reply. */
+	qllm_get_stats(fdi->ctx, &before, 0);
+	if (qllm_seq_prompt(fdi->ctx, buf) < 0) {
+		qsyslog(QLOG_ERR, "qllm_seq_prompt failed\n");
+		ndc_writef(fd, "%s\n", end);
+		return;
+	}
+	if (qllm_get_stats(fdi->ctx, &after, 0) == 0)
+		hist_add(H_PROMPT, after.n_tokenized - before.n_tokenized);
+
+	fdi->ask_at = at;
+	fdi->got_piece = 0;
+	fdi->line_pos = 0;
+	fdi->steps = 0;
+	fdi->stop = 0;
+	fdi->reply = 1;
+	fdi->active = 1;
+}
+
+/*
+ * stats [-r]: the session's performance counters, reset with -r.
+ * Decode time against prefilled and generated tokens tells whether
+ * a session is bound by its prompts or by its replies.
+ */
+void
+do_STATS(int fd, int argc, char *argv[])
+{
+	fdi_t *fdi = &fdis[fd];
+	struct qllm_stats st;
+	int reset = argc > 1 && !strcmp(argv[1], "-r");
+
+	if (fdi->reply) {
+		out_flush(fd, fdi);
+		ndc_writef(fd, "Busy\n%s\n", end);
+		return;
+	}
+
+	if (!fdi->ctx || qllm_get_stats(fdi->ctx, &st, reset) < 0) {
+		ndc_writef(fd, "No session\n%s\n", end);
+		return;
+	}
+
+	ndc_writef(fd, "tokenized %llu\nprefilled %llu\nreused %llu\n"
+	    "generated %llu\n",
+	    (unsigned long long) st.n_tokenized,
+	    (unsigned long long) st.n_prefilled,
+	    (unsigned long long) st.n_reused,
+	    (unsigned long long) st.n_generated);
+	ndc_writef(fd, "tokenize_ms %.3f\ndecode_ms %.3f\nsample_ms %.3f\n"
+	    "detok_ms %.3f\n",
+	    st.t_tokenize_ns / 1e6, st.t_decode_ns / 1e6,
+	    st.t_sample_ns / 1e6, st.t_detok_ns / 1e6);
+	ndc_writef(fd, "reinit %llu\nshift %llu\nkv_used %d\nn_ctx %d\n%s\n",
+	    (unsigned long long) st.n_reinit,
+	    (unsigned long long) st.n_shift,
+	    st.n_kv_used, st.n_ctx, end);
+}
+
+/*
+ * metrics: server-wide latency summaries and gauges, in Prometheus
+ * text format, followed by the end marker.
+ */
+void
+do_METRICS(int fd,
+	   int argc __attribute__((unused)),
+	   char *argv[] __attribute__((unused)))
+{
+	static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+	const struct hist *hi;
+	unsigned sessions = 0, contexts = 0;
+	size_t h, q;
+	int i;
+
+	if (fdis[fd].reply) {
+		out_flush(fd, &fdis[fd]);
+		ndc_writef(fd, "Busy\n%s\n", end);
+		return;
+	}
+
+	for (h = 0; h < H_MAX; h++) {
+		hi = &hists[h];
+		ndc_writef(fd, "# HELP %s %s\n# TYPE %s summary\n",
+		    hi->name, hi->help, hi->name);
+		for (q = 0; q < sizeof(qs) / sizeof(*qs); q++)
+			ndc_writef(fd, "%s{quantile=\"%g\"} %g\n", hi->name,
+			    qs[q], hist_quantile(hi, qs[q]) / hi->scale);
+		ndc_writef(fd, "%s_sum %g\n%s_count %llu\n",
+		    hi->name,
+		    __atomic_load_n(&hi->sum, __ATOMIC_RELAXED) / hi->scale,
+		    hi->name, (unsigned long long)
+		    __atomic_load_n(&hi->count, __ATOMIC_RELAXED));
+	}
+
+	for (i = 0; i < FD_SETSIZE; i++) {
+		sessions += fdis[i].reply != 0;
+		contexts += fdis[i].ctx && fdis[i].ctx != general.ctx;
+	}
+
+	ndc_writef(fd, "# HELP qllmd_active_sessions Replies in progress\n"
+	    "# TYPE qllmd_active_sessions gauge\n"
+	    "qllmd_active_sessions %u\n", sessions);
+	ndc_writef(fd, "# HELP qllmd_live_contexts Sessions holding a"
+	    " sequence\n# TYPE qllmd_live_contexts gauge\n"
+	    "qllmd_live_contexts %u\n"
+	    "# HELP qllmd_max_contexts Sequences available (-n)\n"
+	    "# TYPE qllmd_max_contexts gauge\n"
+	    "qllmd_max_contexts %u\n%s\n", contexts, n_contexts, end);
 }
 
 static inline void
 fdi_init(fdi_t *fdi)
 {
-	struct qllm_config cfg = {
-		.model_path = qllm_model_path,
-		.n_ctx = n_ctx,
-		.n_threads = 0,
-		.n_contexts = n_contexts,
-	};
+	fdi->active = 0;
+	fdi->reply = 0;
 
 	if (fdi->ctx && fdi->ctx != general.ctx)
 		qllm_free(fdi->ctx);
 
-	fprintf(stderr, "N_CONTEXTS! %d\n", cfg.n_contexts);
-	fdi->ctx = qllm_create(&cfg);
-	/* fdi->ctx = general.ctx; */
+	fdi->ctx = qllm_seq_create(pool);
 	if (!fdi->ctx)
-		qsyslog(QLOG_ERR, "Failed to init qllm context\n");
+		qsyslog(QLOG_ERR, "No free qllm sequence\n");
+	else if (qllm_set_stops(fdi->ctx, &end, 1) < 0)
+		qsyslog(QLOG_ERR, "Failed to set stop sequence\n");
 
 	reset_fdi(fdi);
 }
 
+/*
+ * Queue the shared system preamble (crb.txt) on a new session.
+ * Every session starts with the same tokens, so after the first one
+ * this comes straight out of the prefix cache; otherwise it is
+ * prefilled by ndc_update() like any other prompt.
+ */
+static void
+prime_preamble(fdi_t *fdi)
+{
+	char *buf;
+	size_t len;
+
+	if (!crb || !crb_len || !fdi->ctx)
+		return;
+
+	len = crb_len + 64;
+	buf = malloc(len);
+	if (!buf)
+		return;
+
+	snprintf(buf, len, "%ssystem\n%.*s%s\n",
+			start, (int) crb_len, crb, end);
+
+	if (qllm_seq_prefill(fdi->ctx, buf) < 0)
+		qsyslog(QLOG_ERR, "Failed to queue system preamble\n");
+	else {
+		/* Long chats shift out old turns, never the preamble. */
+		qllm_keep(fdi->ctx, -1);
+		fdi->active = 1;
+	}
+
+	free(buf);
+}
+
 void
 do_CHAT(int fd, int argc __attribute__((unused)), char *argv[] __attribute__((unused)))
 {
 	fdi_init(&fdis[fd]);
+
+	if (!fdis[fd].ctx) {
+		ndc_writef(fd, "Server full\n%s\n", end);
+		return;
+	}
+
+	prime_preamble(&fdis[fd]);
 }
 
 struct cmd_slot cmds[] = {
@@ -293,6 +783,14 @@ struct cmd_slot cmds[] = {
 		.name = "chat",
 		.cb = &do_CHAT,
 		.flags = CF_NOAUTH | CF_NOTRIM,
+	}, {
+		.name = "stats",
+		.cb = &do_STATS,
+		.flags = CF_NOAUTH,
+	}, {
+		.name = "metrics",
+		.cb = &do_METRICS,
+		.flags = CF_NOAUTH,
 	}, {
 		.name = NULL
 	}
@@ -306,6 +804,8 @@ ndc_accept(int fd)
 #else
 	reset_fdi(&fdis[fd]);
 #endif
+	fdis[fd].out_len = 0;
+	fdis[fd].accept_at = now_us();
 	return 0;
 }
 
@@ -314,17 +814,22 @@ ndc_disconnect(int fd __attribute__((unused)))
 {
 	fdi_t *fdi = &fdis[fd];
 
+	fdi->active = 0;
+	fdi->reply = 0;
+
 	if (fdi->ctx && fdi->ctx != general.ctx)
 		qllm_free(fdi->ctx);
 
 	fdi->ctx = NULL;
+	fdi->out_len = 0;
 	reset_fdi(fdi);
 }
 
 static void
 usage(char *prog)
 {
-	fprintf(stderr, "Usage: %s [-dr?] [-C PATH] [-u USER] [-k PATH] [-c PATH] [-p PORT] MODEL\n", prog);
+	fprintf(stderr, "Usage: %s [-dr?] [-C PATH] [-u USER] [-k PATH] [-c PATH] [-p PORT] [-M MB] [-b NUM]\n"
+	    "        [-t NUM] [-T NUM] [-A CPUS] [-N NODE] [-P] [-w POLL] MODEL\n", prog);
 	fprintf(stderr, "    Options:\n");
 	fprintf(stderr, "        -C PATH   changes directory to PATH before starting up.\n");
 	fprintf(stderr, "        -u USER   login as USER before starting up.\n");
@@ -334,32 +839,88 @@ usage(char *prog)
 	fprintf(stderr, "        -d        don't detach\n");
 	fprintf(stderr, "        -r        root multiplex mode\n");
 	fprintf(stderr, "        -c SIZE   specify n_ctx (0 - auto)\n");
-	fprintf(stderr, "        -n NUM    specify an estimation of concurrent sessions (2)\n");
+	fprintf(stderr, "        -n NUM    specify the maximum concurrent sessions (4)\n");
+	fprintf(stderr, "        -M MB     prompt prefix cache budget (256, 0 - off)\n");
+	fprintf(stderr, "        -b NUM    tokens decoded per event loop turn (128)\n");
+	fprintf(stderr, "        -t NUM    decode threads (half of the cores used)\n");
+	fprintf(stderr, "        -T NUM    prompt prefill threads (as -t)\n");
+	fprintf(stderr, "        -A CPUS   only use these cores, like 0-7,16-23\n");
+	fprintf(stderr, "        -N NODE   only use the cores of this NUMA node\n");
+	fprintf(stderr, "        -P        pin each thread to a core\n");
+	fprintf(stderr, "        -w POLL   spin 1-100 before sleeping (50, -1 - sleep)\n");
 	fprintf(stderr, "        -?        display this message.\n");
 }
 
 static void
 setup(const char *model_path)
 {
-#if FEAT_GENERAL
+	struct qllm_plan plan;
+	char plan_buf[256];
+	long ret;
+
 	struct qllm_config cfg = {
 		.model_path = model_path,
 		.n_ctx = n_ctx,
 		.n_threads = 0,
-		.n_contexts = n_contexts,
+		.n_contexts = 1,
+		.mode = QLLM_MODE_GENERATE,
+		/* One sequence per session, plus the owner's own. */
+		.n_seq_max = (int32_t) n_contexts + 1,
 	};
 
-	general.ctx = qllm_create(&cfg);
-	CBUG(!general.ctx,
-			"Failed to create qllm context\n");
+	if (cache_mb) {
+		prefix_cache = qllm_cache_create(cache_mb * 1024 * 1024);
+		if (!prefix_cache)
+			qsyslog(QLOG_ERR, "Failed to create prefix cache\n");
+	}
+
+	if (tp_cfg.n_threads || tp_cfg.n_threads_batch || tp_cfg.cpus
+	    || tp_cfg.numa_node || tp_cfg.pin || tp_cfg.poll) {
+		tp = qllm_threadpool_create(&tp_cfg);
+		CBUG(!tp, "Failed to create threadpool\n");
+	}
+
+	/* Fit sessions and KV cache to the RAM we may actually use. */
+	ret = qllm_plan(&cfg, &plan);
+	if (plan.host_avail) {
+		qllm_plan_print(&plan, plan_buf, sizeof(plan_buf));
+		qsyslog(QLOG_INFO, "Memory plan: %s\n", plan_buf);
+	}
+	CBUG(ret < 0 && plan.host_avail,
+			"Not enough memory for even one session\n");
 
+	/* On an unreadable model, qllm_create() below will say. */
+	if (ret == 0)
+		cfg.kv_type = plan.kv_type;
+
+	if (ret == 0 && plan.downsized) {
+		/* Sessions get their own sequences, besides the owner's. */
+		CBUG(plan.n_seq_max < 2, "Not enough memory for a session"
+				" besides the owner sequence\n");
+		n_contexts = (unsigned) plan.n_seq_max - 1;
+		cfg.n_seq_max = plan.n_seq_max;
+		cfg.n_ctx = plan.n_ctx;
+		qsyslog(QLOG_WARNING, "Downsized to %u session(s)"
+				" of %d tokens\n", n_contexts, plan.n_ctx);
+	}
+
+	cfg.cache = prefix_cache;
+	cfg.threadpool = tp;
+	pool = qllm_create(&cfg);
+	CBUG(!pool, "Failed to create qllm context\n");
+
+#if FEAT_GENERAL
+	general.ctx = pool;
 	reset_fdi(&general);
 #endif
 
 	snprintf(qllm_model_path, sizeof(qllm_model_path), "%s", model_path);
 
-	crb_len = (size_t)ndc_mmap(&crb, "crb.txt");
-	(void)crb_len;
+	ret = ndc_mmap(&crb, "crb.txt");
+	if (ret > 0)
+		crb_len = (size_t)ret;
+	else
+		crb = NULL;
 }
 
 int
@@ -372,12 +933,12 @@ main(int argc, char *argv[])
 	FILE *fp;
 	char cmd[BUFSIZ];
 	char *nl;
-	int ret;
+	int ret, i;
 
 	qsys_openlog("qllmd");
 	ndc_config.port = 4242;
 
-	while ((c = getopt(argc, argv, "?dK:k:C:rp:s:n:c:")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "?dK:k:C:rp:s:n:c:M:b:t:T:A:N:Pw:")) != -1) switch (c) {
 		case 'd':
 			ndc_config.flags &= ~NDC_DETACH;
 			break;
@@ -410,6 +971,38 @@ main(int argc, char *argv[])
 			n_ctx = atoi(optarg);
 			break;
 
+		case 'M':
+			cache_mb = (size_t)strtoul(optarg, NULL, 10);
+			break;
+
+		case 'b':
+			step_tokens = (unsigned)atoi(optarg);
+			break;
+
+		case 't':
+			tp_cfg.n_threads = atoi(optarg);
+			break;
+
+		case 'T':
+			tp_cfg.n_threads_batch = atoi(optarg);
+			break;
+
+		case 'A':
+			tp_cfg.cpus = optarg;
+			break;
+
+		case 'N':
+			tp_cfg.numa_node = atoi(optarg) + 1;
+			break;
+
+		case 'P':
+			tp_cfg.pin = 1;
+			break;
+
+		case 'w':
+			tp_cfg.poll = atoi(optarg);
+			break;
+
 		default:
 			usage(*argv);
 			return 1;
@@ -417,7 +1010,7 @@ main(int argc, char *argv[])
 
 	optind = 1;
 
-	while ((c = getopt(argc, argv, "?dK:k:C:rp:s:n:c:")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "?dK:k:C:rp:s:n:c:M:b:t:T:A:N:Pw:")) != -1) switch (c) {
 		case 'K':
 			ndc_certs_add(optarg);
 			break;
@@ -450,13 +1043,20 @@ main(int argc, char *argv[])
 
 	ndc_register("ask", do_ASK, CF_NOAUTH | CF_NOTRIM);
 	ndc_register("chat", do_CHAT, CF_NOAUTH | CF_NOTRIM);
+	ndc_register("stats", do_STATS, CF_NOAUTH);
+	ndc_register("metrics", do_METRICS, CF_NOAUTH);
 
 	setup(arg_model);
 
 	ret = ndc_main();
 
-	if (general.ctx)
-		qllm_free(general.ctx);
+	for (i = 0; i < FD_SETSIZE; i++)
+		if (fdis[i].ctx && fdis[i].ctx != general.ctx)
+			qllm_free(fdis[i].ctx);
+
+	qllm_free(pool);
+	qllm_threadpool_free(tp);
+	qllm_cache_free(prefix_cache);
 
 	return ret;
 }
@@ -0,0 +1,599 @@
+/* schema.c */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A small JSON Schema to GBNF compiler, for constrained generation.
+ * It covers what structured output needs in practice: type (or a list
+ * of them), properties/required, items/minItems, enum, const, anyOf
+ * and oneOf. Anything else is accepted as any JSON value.
+ */
+
+#define SCHEMA_DEPTH 64
+
+enum jv_type {
+	JV_NULL,
+	JV_BOOL,
+	JV_NUM,
+	JV_STR,
+	JV_ARR,
+	JV_OBJ,
+};
+
+struct jv {
+	enum jv_type	 type;
+	char		*key;		/* member name inside an object */
+	char		*str;		/* string, or number as written */
+	int		 b;
+	struct jv	*child;
+	struct jv	*next;
+};
+
+struct jparse {
+	const char	*p;
+	int		 depth;
+};
+
+struct sbuf {
+	char		*p;
+	size_t		 len, cap;
+	int		 err;
+};
+
+struct gen {
+	struct sbuf	 out;
+	unsigned	 n_rules;
+};
+
+static const char gbnf_base[] =
+	"ws ::= [ \\t\\n]{0,20}\n"
+	"string ::= \"\\\"\" ( [^\"\\\\\\x7F\\x00-\\x1F] | \"\\\\\" "
+	"( [\"\\\\/bfnrt] | \"u\" [0-9a-fA-F]{4} ) )* \"\\\"\"\n"
+	"integer ::= \"-\"? ( [0-9] | [1-9] [0-9]{0,15} )\n"
+	"number ::= integer ( \".\" [0-9]+ )? ( [eE] [-+]? [0-9]{1,15} )?\n"
+	"boolean ::= \"true\" | \"false\"\n"
+	"null ::= \"null\"\n"
+	"value ::= object | array | string | number | boolean | null\n"
+	"object ::= \"{\" ws ( string ws \":\" ws value ws "
+	"( \",\" ws string ws \":\" ws value ws )* )? \"}\"\n"
+	"array ::= \"[\" ws ( value ws ( \",\" ws value ws )* )? \"]\"\n";
+
+static void
+jv_free(struct jv *v)
+{
+	struct jv *next;
+
+	for (; v; v = next) {
+		next = v->next;
+		jv_free(v->child);
+		free(v->key);
+		free(v->str);
+		free(v);
+	}
+}
+
+static void
+jp_ws(struct jparse *jp)
+{
+	while (*jp->p == ' ' || *jp->p == '\t' || *jp->p == '\n'
+	       || *jp->p == '\r')
+		jp->p++;
+}
+
+static int
+hex4(const char *s, uint32_t *cp)
+{
+	int i;
+
+	*cp = 0;
+	for (i = 0; i < 4; i++) {
+		char c = s[i];
+
+		*cp <<= 4;
+		if (c >= '0' && c <= '9')
+			*cp |= (uint32_t)(c - '0');
+		else if (c >= 'a' && c <= 'f')
+			*cp |= (uint32_t)(c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F')
+			*cp |= (uint32_t)(c - 'A' + 10);
+		else
+			return -1;
+	}
+
+	return 0;
+}
+
+static size_t
+utf8_put(char *d, uint32_t cp)
+{
+	if (cp < 0x80) {
+		d[0] = (char)cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		d[0] = (char)(0xC0 | (cp >> 6));
+		d[1] = (char)(0x80 | (cp & 0x3F));
+		return 2;
+	}
+	if (cp < 0x10000) {
+		d[0] = (char)(0xE0 | (cp >> 12));
+		d[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+		d[2] = (char)(0x80 | (cp & 0x3F));
+		return 3;
+	}
+	d[0] = (char)(0xF0 | (cp >> 18));
+	d[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+	d[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+	d[3] = (char)(0x80 | (cp & 0x3F));
+	return 4;
+}
+
+/* Parse a JSON string at jp->p (on the quote) into a new C string. */
+static char *
+jp_string(struct jparse *jp)
+{
+	const char *s = jp->p + 1, *e;
+	uint32_t cp, lo;
+	char *out, *d;
+
+	for (e = s; *e && *e != '"'; e++)
+		if (*e == '\\' && e[1])
+			e++;
+	if (*e != '"')
+		return NULL;
+
+	/* Escapes never grow: \uXXXX is 6 bytes for at most 4. */
+	out = d = malloc((size_t)(e - s) + 1);
+	if (!out)
+		return NULL;
+
+	while (s < e) {
+		if (*s != '\\') {
+			*d++ = *s++;
+			continue;
+		}
+
+		s++;
+		switch (*s++) {
+		case '"': *d++ = '"'; break;
+		case '\\': *d++ = '\\'; break;
+		case '/': *d++ = '/'; break;
+		case 'b': *d++ = '\b'; break;
+		case 'f': *d++ = '\f'; break;
+		case 'n': *d++ = '\n'; break;
+		case 'r': *d++ = '\r'; break;
+		case 't': *d++ = '\t'; break;
+		case 'u':
+			if (e - s < 4 || hex4(s, &cp))
+				goto fail;
+			s += 4;
+			if (cp >= 0xD800 && cp < 0xDC00 && e - s >= 6
+			    && s[0] == '\\' && s[1] == 'u'
+			    && !hex4(s + 2, &lo) && lo >= 0xDC00
+			    && lo < 0xE000) {
+				cp = 0x10000 + ((cp - 0xD800) << 10)
+				    + (lo - 0xDC00);
+				s += 6;
+			}
+			d += utf8_put(d, cp);
+			break;
+		default:
+			goto fail;
+		}
+	}
+
+	*d = '\0';
+	jp->p = e + 1;
+	return out;
+
+fail:
+	free(out);
+	return NULL;
+}
+
+static struct jv *
+jp_value(struct jparse *jp)
+{
+	struct jv *v, **tail;
+	const char *s;
+
+	if (++jp->depth > SCHEMA_DEPTH)
+		return NULL;
+
+	jp_ws(jp);
+	v = calloc(1, sizeof(*v));
+	if (!v)
+		return NULL;
+
+	switch (*jp->p) {
+	case '{':
+	case '[':
+		v->type = *jp->p == '{' ? JV_OBJ : JV_ARR;
+		jp->p++;
+		jp_ws(jp);
+		tail = &v->child;
+
+		if (*jp->p == (v->type == JV_OBJ ? '}' : ']')) {
+			jp->p++;
+			break;
+		}
+
+		for (;;) {
+			char *key = NULL;
+
+			jp_ws(jp);
+			if (v->type == JV_OBJ) {
+				if (*jp->p != '"' || !(key = jp_string(jp)))
+					goto fail;
+				jp_ws(jp);
+				if (*jp->p++ != ':') {
+					free(key);
+					goto fail;
+				}
+			}
+
+			*tail = jp_value(jp);
+			if (!*tail) {
+				free(key);
+				goto fail;
+			}
+			(*tail)->key = key;
+			tail = &(*tail)->next;
+
+			jp_ws(jp);
+			if (*jp->p == ',') {
+				jp->p++;
+				continue;
+			}
+			if (*jp->p++ != (v->type == JV_OBJ ? '}' : ']'))
+				goto fail;
+			break;
+		}
+		break;
+
+	case '"':
+		v->type = JV_STR;
+		v->str = jp_string(jp);
+		if (!v->str)
+			goto fail;
+		break;
+
+	case 't':
+	case 'f':
+	case 'n':
+		if (!strncmp(jp->p, "true", 4)) {
+			v->type = JV_BOOL;
+			v->b = 1;
+			jp->p += 4;
+		} else if (!strncmp(jp->p, "false", 5)) {
+			v->type = JV_BOOL;
+			jp->p += 5;
+		} else if (!strncmp(jp->p, "null", 4)) {
+			v->type = JV_NULL;
+			jp->p += 4;
+		} else
+			goto fail;
+		break;
+
+	default:
+		s = jp->p;
+		if (*jp->p == '-')
+			jp->p++;
+		if (*jp->p < '0' || *jp->p > '9')
+			goto fail;
+		while (strchr("0123456789.eE+-", *jp->p) && *jp->p)
+			jp->p++;
+		v->type = JV_NUM;
+		v->str = strndup(s, (size_t)(jp->p - s));
+		if (!v->str)
+			goto fail;
+	}
+
+	jp->depth--;
+	return v;
+
+fail:
+	jv_free(v);
+	return NULL;
+}
+
+static const struct jv *
+jv_get(const struct jv *obj, const char *key)
+{
+	const struct jv *v;
+
+	if (!obj || obj->type != JV_OBJ)
+		return NULL;
+
+	for (v = obj->child; v; v = v->next)
+		if (!strcmp(v->key, key))
+			return v;
+
+	return NULL;
+}
+
+static void
+sb_add(struct sbuf *sb, const char *s, size_t n)
+{
+	char *p;
+	size_t cap;
+
+	if (sb->err)
+		return;
+
+	if (sb->len + n + 1 > sb->cap) {
+		cap = sb->cap ? sb->cap : 1024;
+		while (cap < sb->len + n + 1)
+			cap *= 2;
+		p = realloc(sb->p, cap);
+		if (!p) {
+			sb->err = 1;
+			return;
+		}
+		sb->p = p;
+		sb->cap = cap;
+	}
+
+	memcpy(sb->p + sb->len, s, n);
+	sb->len += n;
+	sb->p[sb->len] = '\0';
+}
+
+static void
+sb_printf(struct sbuf *sb, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (n < 0 || (size_t)n >= sizeof(buf))
+		sb->err = 1;
+	else
+		sb_add(sb, buf, (size_t)n);
+}
+
+/* A GBNF literal matching the JSON encoding of the C string s. */
+static void
+sb_json_lit(struct sbuf *sb, const char *s)
+{
+	const unsigned char *c;
+
+	sb_add(sb, "\"\\\"", 3);
+	for (c = (const unsigned char *)s; *c; c++) {
+		if (*c == '"')
+			sb_add(sb, "\\\\\\\"", 4);
+		else if (*c == '\\')
+			sb_add(sb, "\\\\\\\\", 4);
+		else if (*c < 0x20)
+			sb_printf(sb, "\\\\u%04x", *c);
+		else
+			sb_add(sb, (const char *)c, 1);
+	}
+	sb_add(sb, "\\\"\"", 3);
+}
+
+/* A GBNF literal matching a scalar JSON value as is. */
+static int
+sb_value_lit(struct sbuf *sb, const struct jv *v)
+{
+	switch (v->type) {
+	case JV_STR:
+		sb_json_lit(sb, v->str);
+		return 0;
+	case JV_NUM:
+		sb_printf(sb, "\"%s\"", v->str);
+		return 0;
+	case JV_BOOL:
+		sb_add(sb, v->b ? "\"true\"" : "\"false\"", v->b ? 6 : 7);
+		return 0;
+	case JV_NULL:
+		sb_add(sb, "\"null\"", 6);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static int gen_schema(struct gen *g, const struct jv *schema, char *name,
+		      size_t size);
+
+/* Rule body for one "type" of a schema. */
+static int
+gen_type(struct gen *g, const struct jv *schema, const char *type,
+	 struct sbuf *body)
+{
+	const struct jv *props, *req, *items, *min, *p, *r;
+	char name[32];
+	int first = 1, pass, is_req, n_req = 0;
+
+	if (!strcmp(type, "string") || !strcmp(type, "number")
+	    || !strcmp(type, "integer") || !strcmp(type, "boolean")
+	    || !strcmp(type, "null")) {
+		sb_printf(body, "%s", type);
+		return 0;
+	}
+
+	if (!strcmp(type, "array")) {
+		items = jv_get(schema, "items");
+		min = jv_get(schema, "minItems");
+
+		if (!items)
+			snprintf(name, sizeof(name), "value");
+		else if (gen_schema(g, items, name, sizeof(name)) != 0)
+			return -1;
+
+		if (min && min->type == JV_NUM && atoi(min->str) > 0)
+			sb_printf(body, "\"[\" ws %s ws ( \",\" ws %s ws )* \"]\"",
+			    name, name);
+		else
+			sb_printf(body, "\"[\" ws ( %s ws ( \",\" ws %s ws )* )? \"]\"",
+			    name, name);
+		return 0;
+	}
+
+	if (strcmp(type, "object"))
+		return -1;
+
+	props = jv_get(schema, "properties");
+	if (!props || props->type != JV_OBJ || !props->child) {
+		sb_printf(body, "object");
+		return 0;
+	}
+
+	req = jv_get(schema, "required");
+	if (req && req->type == JV_ARR)
+		for (r = req->child; r; r = r->next)
+			n_req += r->type == JV_STR && jv_get(props, r->str);
+
+	/*
+	 * Required properties first, in schema order, then the optional
+	 * ones, each of which may be left out. If none is required, all
+	 * of them are treated as required.
+	 */
+	sb_printf(body, "\"{\" ws ");
+	for (pass = 0; pass < 2; pass++) {
+		for (p = props->child; p; p = p->next) {
+			is_req = !n_req;
+			if (req && req->type == JV_ARR)
+				for (r = req->child; r; r = r->next)
+					if (r->type == JV_STR
+					    && !strcmp(r->str, p->key))
+						is_req = 1;
+
+			if (is_req != !pass)
+				continue;
+
+			if (gen_schema(g, p, name, sizeof(name)) != 0)
+				return -1;
+
+			sb_printf(body, is_req ? "" : "( ");
+			if (!first)
+				sb_printf(body, "\",\" ws ");
+			sb_json_lit(body, p->key);
+			sb_printf(body, " ws \":\" ws %s ws %s", name,
+			    is_req ? "" : ")? ");
+			first = 0;
+		}
+	}
+	sb_printf(body, "\"}\"");
+	return 0;
+}
+
+/*
+ * Emit a rule for schema and put its name in name.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+gen_schema(struct gen *g, const struct jv *schema, char *name, size_t size)
+{
+	const struct jv *v, *type;
+	struct sbuf body = { 0 };
+	const char *sep = "";
+	char sub[32];
+
+	if (schema->type == JV_BOOL || (schema->type == JV_OBJ
+	    && !schema->child)) {
+		snprintf(name, size, "value");
+		return 0;
+	}
+	if (schema->type != JV_OBJ)
+		return -1;
+
+	if ((v = jv_get(schema, "const"))) {
+		if (sb_value_lit(&body, v) != 0)
+			goto fail;
+	} else if ((v = jv_get(schema, "enum")) && v->type == JV_ARR) {
+		for (v = v->child; v; v = v->next) {
+			sb_printf(&body, "%s", sep);
+			if (sb_value_lit(&body, v) != 0)
+				goto fail;
+			sep = " | ";
+		}
+	} else if (((v = jv_get(schema, "anyOf"))
+		    || (v = jv_get(schema, "oneOf"))) && v->type == JV_ARR) {
+		for (v = v->child; v; v = v->next) {
+			if (gen_schema(g, v, sub, sizeof(sub)) != 0)
+				goto fail;
+			sb_printf(&body, "%s%s", sep, sub);
+			sep = " | ";
+		}
+	} else if ((type = jv_get(schema, "type"))) {
+		if (type->type == JV_STR) {
+			if (gen_type(g, schema, type->str, &body) != 0)
+				goto fail;
+		} else if (type->type == JV_ARR) {
+			for (v = type->child; v; v = v->next) {
+				sb_printf(&body, "%s( ", sep);
+				if (v->type != JV_STR
+				    || gen_type(g, schema, v->str, &body) != 0)
+					goto fail;
+				sb_printf(&body, " )");
+				sep = " | ";
+			}
+		} else
+			goto fail;
+	} else {
+		snprintf(name, size, "value");
+		return 0;
+	}
+
+	if (body.err || !body.len)
+		goto fail;
+
+	snprintf(name, size, "r%u", ++g->n_rules);
+	sb_printf(&g->out, "%s ::= ", name);
+	sb_add(&g->out, body.p, body.len);
+	sb_add(&g->out, "\n", 1);
+	free(body.p);
+	return 0;
+
+fail:
+	free(body.p);
+	return -1;
+}
+
+/*
+ * Compile a JSON schema into a GBNF grammar with a "root" rule.
+ * Returns a malloc'd string, or NULL on error.
+ */
+char *
+qllm_schema_gbnf(const char *schema)
+{
+	struct jparse jp = { .p = schema };
+	struct gen g = { 0 };
+	struct jv *root;
+	char name[32];
+
+	if (!schema)
+		return NULL;
+
+	root = jp_value(&jp);
+	if (!root)
+		return NULL;
+
+	jp_ws(&jp);
+	if (*jp.p != '\0' || gen_schema(&g, root, name, sizeof(name)) != 0) {
+		jv_free(root);
+		free(g.out.p);
+		return NULL;
+	}
+
+	jv_free(root);
+	sb_printf(&g.out, "root ::= ws %s\n", name);
+	sb_add(&g.out, gbnf_base, sizeof(gbnf_base) - 1);
+
+	if (g.out.err) {
+		free(g.out.p);
+		return NULL;
+	}
+
+	return g.out.p;
+}
@@ -0,0 +1,196 @@
+/* trace.c */
+
+#include "./../include/ttypt/qllm.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Timeline tracing: spans go into a ring per thread, written only by
+ * that thread, and are dumped as Chrome trace-event JSON (which
+ * Perfetto and chrome://tracing open as is). When tracing is off, each
+ * probe costs one predictable branch on qllm_trace_on.
+ */
+
+#define TRACE_RING (1 << 16)	/* spans kept per thread, newest win */
+
+struct trace_span {
+	const char	*name;		/* static string */
+	uint64_t	 ts;		/* ns, monotonic */
+	uint64_t	 dur;
+	int64_t		 arg;
+};
+
+struct trace_ring {
+	struct trace_ring	*next;
+	unsigned		 tid;
+	uint64_t		 head;		/* spans ever written */
+	struct trace_span	 spans[TRACE_RING];
+};
+
+int qllm_trace_on;
+
+static char *trace_path;
+static struct trace_ring *rings;
+static unsigned n_rings;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct trace_ring *ring;
+
+static inline uint64_t
+trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/* This thread's ring, registered on first use. */
+static struct trace_ring *
+trace_ring(void)
+{
+	struct trace_ring *r;
+
+	if (ring)
+		return ring;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	pthread_mutex_lock(&trace_lock);
+	r->tid = ++n_rings;
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&trace_lock);
+
+	ring = r;
+	return r;
+}
+
+/* Record a span from t0 to t1 (ns, monotonic). */
+void
+qllm_trace_span(const char *name, uint64_t t0, uint64_t t1, int64_t arg)
+{
+	struct trace_ring *r = trace_ring();
+	struct trace_span *sp;
+	uint64_t head;
+
+	if (!r)
+		return;
+
+	head = r->head;
+	sp = &r->spans[head & (TRACE_RING - 1)];
+	sp->name = name;
+	sp->ts = t0;
+	sp->dur = t1 - t0;
+	sp->arg = arg;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t
+qllm_trace_begin(void)
+{
+	return qllm_trace_on ? trace_now() : 0;
+}
+
+void
+qllm_trace_end(const char *name, uint64_t t0, int64_t arg)
+{
+	if (qllm_trace_on && t0)
+		qllm_trace_span(name, t0, trace_now(), arg);
+}
+
+int
+qllm_trace_start(const char *path)
+{
+	char *p;
+
+	if (!path || !*path)
+		return -1;
+
+	p = strdup(path);
+	if (!p)
+		return -1;
+
+	pthread_mutex_lock(&trace_lock);
+	free(trace_path);
+	trace_path = p;
+	pthread_mutex_unlock(&trace_lock);
+
+	__atomic_store_n(&qllm_trace_on, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int
+qllm_trace_flush(void)
+{
+	const struct trace_span *sp;
+	struct trace_ring *r;
+	uint64_t head, i;
+	int pid = (int) getpid(), first = 1, ret = 0;
+	FILE *fp;
+
+	pthread_mutex_lock(&trace_lock);
+
+	if (!trace_path) {
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+
+	fp = fopen(trace_path, "w");
+	if (!fp) {
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	for (r = rings; r; r = r->next) {
+		fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+		    "\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"qllm %u\"}}",
+		    first ? "" : ",", pid, r->tid, r->tid);
+		first = 0;
+
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		i = head > TRACE_RING ? head - TRACE_RING : 0;
+
+		for (; i < head; i++) {
+			sp = &r->spans[i & (TRACE_RING - 1)];
+			fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\","
+			    "\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+			    "\"args\":{\"n\":%lld}}",
+			    sp->name, pid, r->tid, sp->ts / 1e3,
+			    sp->dur / 1e3, (long long) sp->arg);
+		}
+	}
+
+	fprintf(fp, "\n]}\n");
+	if (fclose(fp) != 0)
+		ret = -1;
+
+	pthread_mutex_unlock(&trace_lock);
+	return ret;
+}
+
+/* QLLM_TRACE=path traces the whole run, dumped at exit. */
+__attribute__((constructor)) static void
+qllm_trace_init(void)
+{
+	const char *path = getenv("QLLM_TRACE");
+
+	if (path && *path)
+		qllm_trace_start(path);
+}
+
+__attribute__((destructor)) static void
+qllm_trace_fini(void)
+{
+	if (qllm_trace_on)
+		qllm_trace_flush();
+}